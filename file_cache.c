@@ -5,14 +5,15 @@
 
 /* Design of User level File Cache:
  *
- * This file cahe is implemented at User level and each process calling the constructor
- * will have its own instance of file_cache. Though within a process all threads shares
- * the same file_cache. 
+ * This file cahe is implemented at User level. Each call to the constructor returns an instance
+ * of its own, and the threads of a process share an instance by sharing the pointer to it.
+ * Instances have nothing in common, no global lock or state, so a process may run any number of
+ * them side by side, e.g. one per tenant, each with its own capacity and its own locks.
  *
  * The constructor initializes a structure file_cache which has all the meta data for the 
  * file cache. This consructor hold a poniter to memory on heap of type struct __node_cache
  * which is an array of structures of size max_cache_entries. Each structure in this array 
- * contains a char * pointer to the actual cache of size 10Kb allocated on heap along with
+ * contains a char * pointer to the actual cache of size 10Kb in the buffer arena along with
  * house keeping variables such as refrenceCount and dirty which keeps track of no of threads
  * which have 'pined' the cache in the memory and if cache is written to since it was read into 
  * memory and a char *name poninter which points to the name of the file cached into that cache node.
@@ -24,138 +25,3551 @@
  * |int maxSize     |  array of structure type (struct __node_cache) size max_cache_entries
  * |int currentSize |      |--------------------|
  * |*nodeHead	    |----> |int refCount        |
- * |func ptrs ...___|      |char dirty          |
- *			   |char *name          |---->[pointer to heap mem of size of file name char string]
- *                         |char *cache         |---->[poniter to heap mem of size 10Kb]
+ * |*shards         |      |char dirty          |
+ * |*arena          |	   |char *name          |---->[pointer to heap mem of size of file name char string]
+ * |func ptrs ...___|      |char *cache         |---->[poniter to slot's buffer of 'size' bytes in the arena]
  *			   |____________________|
  *
+ * Files have any size, taken with fstat() when a miss opens them, and the capacity of the cache
+ * is maxBytes of file data as well as maxSize files. All the buffers are carved out of one page
+ * aligned arena of maxBytes, mapped once by the constructor (on huge pages if asked for) and
+ * unmapped by the destructor, so a miss or an eviction never calls malloc() or free() for file
+ * data. Every shard owns an equal run of the arena and hands out buffers from it with a buddy
+ * allocator: the size classes are the powers of 2 from 512 bytes up, with a free list per class,
+ * and a block is split down to the class of the file. The unused tail of the block is given
+ * straight back, so a buffer wastes less than 512 bytes, and freed blocks merge with their free
+ * buddies. Where no block is big enough the buffer takes the first run of adjacent free blocks
+ * that is, so a file fits wherever the free space around the other buffers does. With
+ * file_cache_conf.padTo10Kb a buffer is never smaller than 10Kb, the size every file used to
+ * have. A file bigger than the run of its
+ * shard is not cached, and neither is one a pin batch can't place even in its emptied shard: with
+ * nobody else holding a pin in the shard, waiting would never make room. The name buffer of a slot is
+ * kept across evictions and only regrown for a longer name.
  *
+ *  size classes   freeBlock[0]  512b  -> blk -> blk
+ *                 freeBlock[1]  1Kb   -> blk
+ *                 ...
+ *                 freeBlock[k]  512b << k
  *
- * The file_cache uses 2 mutex variables 'metaLock' & 'pinLock' and a condition variable 'slotcv' to synchronise
- * file cache creation and the pin and unpinning of files in the file cache respectively.
- * metaLock allows only one thread to enter the constructor and desctructor at a time, therby enforcing singelton pattern.
- * pinLock synchronises the access to pin and unpin access to file cache, if there a no empty slot the thread will block on 
- * slotcv condition variable which is signaled in unpin function whenever an empty slot opens up.
+ * File I/O bypasses stdio. A miss reads with pread() straight into the slot's buffer and the slot
+ * keeps the descriptor it read through, so its writebacks are a pwrite() on it without opening
+ * the file again. The descriptors kept across the cache are bounded by maxOpenFds; past that a
+ * slot closes its descriptor after the read and a writeback opens the file for itself. An evicted
+ * slot closes its descriptor.
+ *
+ * In FILE_CACHE_MODE_MMAP there is no arena. A miss maps the file MAP_SHARED and the slot's
+ * cache pointer points straight into that mapping, so the data functions hand out the page cache
+ * pages themselves: no copy on a miss, none on writeback (which becomes an msync()), and the
+ * pages are shared with every other process mapping or reading the file. The mapped bytes are
+ * charged against the shard's maxBytes. Eviction unmaps the slot. A file open read-only is mapped
+ * PROT_READ and can't be made mutable, and an empty file, which has nothing to map, is served
+ * from zeroBuf. Everything else, pins, LRU, dirty lists and the flusher, works
+ * the same in both modes.
+ *
+ * Free slots of a shard are chained on its free list (freeHead, linked
+ * through lruNext), so finding a free slot is a pop instead of a scan.
+ *
+ *
+ *
+ * nodeHead is partitioned into numShards shards (struct __cache_shard), each owning a contiguous
+ * run of slots. The shard of a file is picked by the top bits of the hash of its name, so a file
+ * can only ever live in the slots of its own shard.
+ *
+ *  shards[]                    nodeHead[]
+ *  | shard 0: firstSlot 0  |-->| slot 0 .. slot k-1      |
+ *  | shard 1: firstSlot k  |-->| slot k .. slot 2k-1     |
+ *  | ...                   |   | ...                     |
+ *
+ * Within a shard files are looked up by name through a chained hash index. hashHead is an
+ * array of buckets, each holding the slot number of the first node whose name hashes into it, and
+ * the nodes of a bucket are chained through their 'hnext' member. Each node also caches the hash of
+ * its name so that a lookup only calls strcmp() on a real candidate. Pin, unpin and the data calls
+ * therefore cost O(1) instead of a strcmp() against every slot.
+ *
+ *  hashHead[]            nodeHead[]
+ *  |  -1  |              |..........|
+ *  |   3 -|------------> | slot 3   |--hnext--> slot 0 --hnext--> -1
+ *  |  -1  |              |..........|
+ *
+ * Creation and destruction of a cache need no lock since no other thread can know of the
+ * instance before the constructor returns it, or use it once it is passed to the destructor.
+ * Each shard has its own mutex 'lock', which synchronises the pin and unpin of the files of that
+ * shard, and its own admission queue. Pins and unpins of files in different shards run in parallel.
+ * file_cache_file_data() and file_cache_file_size() take no lock at all. The index of a shard is
+ * guarded for them by a seqlock, 'seq', which index_add() and index_del() make odd for the few
+ * stores of a change: a reader walks the index and retries if seq was odd or moved meanwhile.
+ * Name buffers are only ever outgrown, never freed while the cache lives, so even a walk that is
+ * retried never reads freed memory. The mutable calls still lock, to mark the slot dirty.
+ *
+ * Unpinning the last pin of a file does not drop it. The slot stays resident, with its data and
+ * its dirty byte, and goes on the LRU list of its shard; pinning it again is a memory hit that
+ * just takes it off the list. Only when a miss finds no free slot in the shard is the least
+ * recently used unpinned slot (lruHead) evicted, after writing it back to disk if it is dirty.
+ * The list is intrusive, threaded through the lruPrev/lruNext slot numbers of the nodes, but
+ * keeps the same order as the LRU list of HashTable/ LruTable: oldest at the head, newest at
+ * the tail.
+ *
+ *  lruHead                                       lruTail
+ *  | slot 7 | <--> | slot 2 | <--> ... <--> | slot 5 |
+ *  (evicted first)                          (unpinned last)
+ *
+ * Plain LRU lets one pass over a lot of cold files, each pinned once, push every file in steady use
+ * out of the cache. FILE_CACHE_POLICY_SLRU splits the resident slots in two segments. A file
+ * goes on the LRU list (probation) when read in, and is marked 'hot' when pinned again while
+ * resident. A file read in by a prefetch or a warm restart isn't referenced yet: its first pin
+ * leaves it on probation, only a second one makes it hot. A hot slot is unpinned onto the protected list instead, which holds at most
+ * FC_SLRU_PROTECTED_PCT of the shard's slots; the oldest protected slot beyond that goes back to
+ * the tail of the LRU list, no longer hot. Eviction takes the LRU head first and touches the
+ * protected list only once the LRU list is empty, so a scan only cycles through probation.
+ *
+ *  lruHead (probation)          lruTail     protHead (protected)          protTail
+ *  | scan | <--> ... <--> | scan |         | hot | <--> ... <--> | hot |
+ *  evicted first             ^                |   demoted when full
+ *                            +----------------+
+ *
+ * Dirty slots are never written back under a shard lock. When the last pin of a dirty slot goes
+ * away it is put on the shard's dirty list instead of the LRU list, and unpin returns right away.
+ * A background flusher thread (flusher_main()) wakes up every flushIntervalMs, or as soon as
+ * dirtySize reaches flushHighWater or a pinner is short of slots, and drains the dirty lists:
+ * under the shard lock it takes a slot off the list, clears its dirty byte and marks it
+ * 'flushing', drops the lock for the write, and then relocks to put the now clean slot at the
+ * tail of the LRU list. A slot pinned while being flushed is simply left to its next unpin, and a
+ * slot dirtied again while being flushed goes back on the dirty list. Only clean slots are ever
+ * on the LRU list, so eviction never does I/O.
+ * Writeback alone doesn't make the data durable. file_cache_sync() has the flusher run a pass
+ * that writes back every dirty slot and fdatasync()s each file it wrote, and the syncs of all the
+ * threads calling in within groupCommitUs are served by that one pass (group commit). With
+ * 'durable' set every pass of the flusher, destroy's included, syncs what it writes.
+ *
+ * Given a write log (file_cache_conf.logPath, FILE_CACHE_MODE_COPY only) the flusher turns those
+ * syncs into one sequential append. Each dirty run becomes a record of the log, header, file name
+ * and data, and is then written in place without a sync. A pass that has to be durable syncs just
+ * the log. Once the log passes logMax bytes a checkpoint syncs each file named in it and empties
+ * it. A crash leaves the records since the last checkpoint, and the constructor replays them into
+ * their files, up to the first torn or corrupt one, before the cache is used.
+ *
+ *  flusher pass:  dirty a, b, c ---> | rec a | rec b | rec c |  fdatasync(log)   sync() returns
+ *                         \--------> pwrite in place, unsynced
+ *  checkpoint:    fdatasync(a), fdatasync(b), fdatasync(c), truncate(log)
+ *
+ * A file that is all zero is read once into no memory at all. load_batch() skips the read of a
+ * file with no data on disk (SEEK_DATA finds none, as for the files the cache creates for missing
+ * ones) and checks what it did read for zeros. Such a slot keeps its buffer in the arena, but
+ * its pages are given back to the kernel and file_cache_file_data() returns the cache's zeroBuf,
+ * one read-only mapping of zeros shared by all of them. The first file_cache_mutable_file_range()
+ * on the slot zeroes its own buffer and hands that out from then on.
+ *
+ * Writeback only rewrites what changed. Each slot has a 256 bit dirtyMap, one bit per granule of
+ * 512 bytes (4Kb for files over 128Kb, larger still past 1Mb), set by
+ * file_cache_mutable_file_range() for the bytes a writer touches; file_cache_mutable_file_data()
+ * marks the whole file. The flusher takes a copy of the map and clears it along with the dirty
+ * byte, then issues one pwrite() (or msync()) per run of set bits. A failed write ORs its copy
+ * back into the map, and bits set during the write stay set for the next pass.
+ * Callers often ask for mutable access without writing anything, so in FILE_CACHE_MODE_COPY a
+ * slot also keeps the CRC32C of its data as read in or last written back, and a dirty slot whose
+ * data still has that checksum is marked clean without being written.
+ *
+ * A pin needs a slot for every file of its batch that isn't pinned already, and it reserves all of
+ * them before it takes any. The room of a shard is its free slots plus its LRU (and protected)
+ * slots, less the slots already reserved ('reserved'). A batch that fits and finds nobody queued takes its slots
+ * right away; otherwise it queues up at the tail of the shard's admission queue (admitHead) and
+ * sleeps on a condition variable of its own. Whenever room grows, an unpin to the LRU list, a slot
+ * flushed clean or freed, or a reservation given back, admit_grant() hands it out from the head of
+ * the queue, waking exactly the batches it is enough for, in arrival order. A batch spanning
+ * several shards takes them in ascending order, each one reserved and pinned whole before the
+ * next. So two batches can never pin part of what they need each and then wait on one another, and a large batch is not starved by small ones:
+ *
+ *  admitHead                                admitTail
+ *  | need 3 | ---> | need 1 | ---> | need 2 |        room 2: nobody wakes, the head needs 3
+ *
+ * Once its reservation is granted a batch sets a buffer aside for every miss of the shard, and
+ * only if all of them fit does it pin its files there, before it moves on to the next shard. A
+ * batch that has the slots but not the bytes waits on the shard's slotcv, which is broadcast with
+ * every slot that opens up, holding no pin in that shard and having read the misses it claimed
+ * elsewhere, so nobody waits on it in turn. A queued batch kicks the flusher, since dirty slots
+ * are room once written back.
+ * file_cache_try_pin_files() and file_cache_timed_pin_files() bound all of that: where the
+ * blocking pin would wait, in the admission queue, on slotcv or on another pin's read, they wait only until their deadline
+ * (none at all for the try pin) and then undo the batch, dropping every pin it took once the
+ * misses it claimed are read in, so a caller is never left with half a batch.
+ *
+ * Files are not read under a shard lock either. A pin first walks its whole batch under the shard
+ * locks, and every miss claims a slot: the slot is indexed under the file's name, pinned and
+ * marked 'loading'. Then load_batch() reads all the claimed slots at once, outside of any lock,
+ * through an io_uring owned by the pinning thread, or through the cache's pool of io workers
+ * where the kernel has no io_uring and in FILE_CACHE_MODE_MMAP. A batch of misses therefore takes
+ * about as long as its slowest read. Another thread pinning a file that is still loading gets its
+ * pin at once and then waits on the shard's loadcv for the read to land.
+ * file_cache_prefetch_files() hands its files to the same io workers, which read them in
+ * between load jobs with a try pin followed by an unpin, so a prefetched file is simply a
+ * resident slot at the LRU tail that the next pin finds as a hit.
+ * A warm restart goes the same way: given file_cache_conf.manifestPath, destroy (or
+ * file_cache_save_manifest()) lists the resident files there, most recently used first, and the
+ * next constructor queues them as prefetches in that order, so pins never wait behind them.
+ * A cache without io workers doesn't read the manifest back, it would have to in the constructor.
+ *
+ *  pin(a, b, c)   claim a, b, c     load_batch()                  done
+ *                 (shard locks)     read a ---->|
+ *                                   read b ------->|              a, b, c
+ *                                   read c -->|    |              loaded
+ *
+ * Since every shard owns maxSize / numShards slots, a client pinning close to maxSize files at
+ * once may block on a full shard before the cache as a whole is full. The default shard count
+ * keeps at least FC_MIN_SHARD_ENTRIES slots per shard so that this only matters for clients
+ * running the cache right at its limit.
  *
  * Developed & tested on Ubuntu 32bit with gcc 4.4.3
  *
- */                            
+ */                            
+
+#define _GNU_SOURCE                /* fallocate() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sched.h>
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <linux/io_uring.h>
+# endif
+#endif
+#include "file_cache.h"
+
+#if defined(IORING_OP_READV) && defined(__NR_io_uring_setup)
+# define FC_HAVE_IO_URING 1
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+# include <nmmintrin.h>
+# define FC_HAVE_CRC32C_SSE42 1
+#endif
+
+#define CACHE_SIZE 10240     /* 10 Kb = 10*1024 Bytes, size of a file created for a missing one */
+
+#define FC_MAX_SHARDS 64           /* Upper bound on numShards, must be a power of 2 */
+#define FC_SHARD_BITS 6            /* log2(FC_MAX_SHARDS): shard is picked by the top bits of the hash */
+#define FC_MIN_SHARD_ENTRIES 64    /* Default shard count keeps at least this many slots per shard */
+#define FC_FLUSH_INTERVAL_MS 1000  /* Default period of the background flusher */
+#define FC_GROUP_COMMIT_US 1000    /* Default window in which file_cache_sync() calls are grouped */
+#define FC_LOG_MAGIC 0x474c4346u   /* "FCLG", starts every record of the write log */
+#define FC_LOG_NAME_MAX 4096       /* Longest file name a record of the write log may carry */
+#define FC_LOG_MAX_BYTES (64UL << 20)  /* Default size of the write log that triggers a checkpoint */
+#define FC_MANIFEST_MAGIC "file_cache manifest 1"  /* First line of a manifest, see file_cache_save_manifest() */
+#define FC_CRC32C_POLY 0x82f63b78u /* CRC32C (Castagnoli) polynomial, bit reversed */
+
+#define FC_LIST_LRU 1              /* Slot is on the LRU list of its shard */
+#define FC_LIST_DIRTY 2            /* Slot is on the dirty list of its shard */
+#define FC_LIST_FREE 3             /* Slot is on the free list of its shard */
+#define FC_LIST_PROT 4             /* Slot is on the protected list of its shard */
+
+#define FC_SLRU_PROTECTED_PCT 80   /* Share of a shard's slots the protected list of FILE_CACHE_POLICY_SLRU may hold */
+
+#define FC_NAME_MIN 64             /* Smallest name buffer of a slot */
+#define FC_HUGE_PAGE_SIZE (2UL << 20)
+
+#define FC_BLOCK_SHIFT 9                 /* Buffers are allocated in units of 512 bytes */
+#define FC_MIN_BLOCK (1 << FC_BLOCK_SHIFT)
+#define FC_ENTRY_BYTES 16384             /* Default bytes per entry: the block a 10Kb file takes */
+#define FC_MIN_SHARD_BYTES (4UL << 20)   /* Default shard count leaves every shard room for a 4Mb file */
+
+#define FC_IO_THREADS 8            /* Default size of the pool loading the misses of a batch */
+#define FC_PIN_STACK 16            /* Pin batches up to this size keep their load jobs on the stack */
+#define FC_RING_ENTRIES 64         /* Submission queue size of a thread's io_uring */
+#define FC_PIN_SKIP (-2)           /* A file of a pin batch found missing, too big, or with no room ever */
+#define FC_PIN_DONE (-3)           /* A file of a pin batch pinned */
+#define FC_PIN_DUP (-4)            /* A file named earlier in the same pin batch, pinned along with it */
+#define FC_SEQ_SPINS 64            /* Retries of a lock-free lookup that spin before it yields the CPU */
+
+/* @param: const char *name: file name to hash.
+ *   len: set to strlen(name), which a lookup compares before the name itself.
+ * @ret: 32 bit FNV-1a hash of the name.
+ */
+static unsigned int hash_name(const char *name, size_t *len)
+{
+    const char *p = name;
+    unsigned int hash = 2166136261u;
+
+    while ( *p ) {
+	hash ^= (unsigned char) *p++;
+	hash *= 16777619u;
+    }
+    *len = p - name;
+    return hash;
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   hash: hash_name() of a file name.
+ * @ret: the shard the file belongs to.
+ * Notes:
+ * Uses the top bits of the hash, the shard index uses the bottom ones.
+ */
+static struct __cache_shard *shard_of(file_cache *cache, unsigned int hash)
+{
+    return &cache->shards[(hash >> (32 - FC_SHARD_BITS)) & (cache->numShards - 1)];
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   slot: slot number in nodeHead.
+ * @ret: the shard owning the slot. The constructor gives the first maxSize % numShards shards
+ *   one slot more than the others.
+ */
+static struct __cache_shard *shard_of_slot(file_cache *cache, int slot)
+{
+    int per = cache->maxSize / cache->numShards;
+    int extra = cache->maxSize % cache->numShards;
+
+    if ( slot < extra * (per + 1) )
+	return &cache->shards[slot / (per + 1)];
+    return &cache->shards[extra + (slot - extra * (per + 1)) / per];
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   node: pinned and loaded slot.
+ * @ret: the data readers get: the slot's buffer, or the shared zeroBuf while it is all zero.
+ */
+static const char *slot_data(file_cache *cache, struct __node_cache *node)
+{
+    return __atomic_load_n(&node->zero, __ATOMIC_ACQUIRE) ? cache->zeroBuf : node->cache;
+}
+
+/* Name buffer of a slot. A slot's buffer is only ever replaced by a larger one, and neither is
+ * freed before the cache is, so a lock-free reader holding a stale name pointer can still read
+ * 'cap' bytes through it.
+ */
+struct __name_buf {
+    struct __name_buf *next;    /* Next outgrown buffer on the shard's retiredNames */
+    int cap;                    /* Bytes at name */
+    char name[];
+};
+
+#define NAME_BUF(p) ((struct __name_buf *) ((p) - offsetof(struct __name_buf, name)))
+
+/* @param: cache: pointer to file_cache structure.
+ *   shard: shard of the file.
+ *   name: file name to look up.
+ *   hash, len: hash_name() of name and the length it found.
+ * @ret: slot number in nodeHead of the pinned file 'name' or -1 if not present.
+ * Notes:
+ * A slot's hash and name length are compared first, so the bytes of the name are only compared
+ * once, with a memcmp(), on the slot that holds it.
+ */
+static int index_find(file_cache *cache, struct __cache_shard *shard, const char *name, unsigned int hash,
+		      size_t len)
+{
+    int slot = shard->hashHead[hash & shard->hashMask];
+    struct __node_cache *node;
+
+    while ( slot >= 0 ) {
+	node = &cache->nodeHead[slot];
+	if ( node->hash == hash && node->nameLen == len && 0 == memcmp(name, node->name, len) )
+	    return slot;
+	slot = node->hnext;
+    }
+    return -1;
+}
+
+/* @param: spins: retries so far, bumped.
+ * Notes:
+ * Backs off a retry of index_read(): a pause hint to the CPU for the first FC_SEQ_SPINS, so a
+ * spinning reader doesn't starve the sibling hyperthread or flood the bus, then sched_yield() so
+ * that a writer preempted halfway through a change gets to finish it.
+ */
+static void seq_backoff(unsigned int *spins)
+{
+    if ( ++*spins > FC_SEQ_SPINS ) {
+	sched_yield();
+	return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield" ::: "memory");
+#endif
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   shard: shard of the file, not locked.
+ *   name: file name to look up.
+ *   hash, len: hash_name() of name and the length it found.
+ *   size: set to the bytes of the file's data when it is found.
+ * @ret: the data of the pinned and loaded file 'name' (the shared zeroBuf if it is all zero),
+ *   NULL if it is not pinned.
+ *
+ * Notes:
+ * index_find() for the readers, without the shard lock. The walk reads the index as it is,
+ * possibly halfway through a change by a pin or unpin, and is only trusted if the shard's seq was
+ * even before and unchanged after it; otherwise it is walked again, after seq_backoff(). Name buffers are never
+ * freed under a walk and every link is a valid slot number, so a walk of a changing index reads
+ * nothing it shouldn't, and the bound on its steps ends one caught in a cycle. The state of a
+ * slot the caller has pinned doesn't change under it, except for 'loading', published with a
+ * release once the data is in, and 'zero', cleared only once the slot's own buffer is zeroed.
+ */
+static const char *index_read(file_cache *cache, struct __cache_shard *shard, const char *name,
+			      unsigned int hash, size_t len, size_t *size)
+{
+    struct __node_cache *node;
+    const char *data, *nm;
+    unsigned int seq, spins = 0;
+    int slot, steps;
+
+    for ( ;; seq_backoff(&spins) ) {
+	seq = __atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE);
+	if ( seq & 1 )
+	    continue;
+	data = NULL;
+	node = NULL;
+	slot = __atomic_load_n(&shard->hashHead[hash & shard->hashMask], __ATOMIC_RELAXED);
+	for ( steps = 0; slot >= 0 && steps < shard->maxSize; steps++ ) {
+	    node = &cache->nodeHead[slot];
+	    nm = __atomic_load_n(&node->name, __ATOMIC_RELAXED);
+	    if ( __atomic_load_n(&node->hash, __ATOMIC_RELAXED) == hash && nm
+		 && __atomic_load_n(&node->nameLen, __ATOMIC_RELAXED) == len
+		 && len < (size_t) NAME_BUF(nm)->cap && 0 == memcmp(nm, name, len) )
+		break;
+	    slot = __atomic_load_n(&node->hnext, __ATOMIC_RELAXED);
+	}
+	if ( slot >= 0 && steps < shard->maxSize && __atomic_load_n(&node->refCount, __ATOMIC_RELAXED) > 0
+	     && !__atomic_load_n(&node->loading, __ATOMIC_ACQUIRE)
+	     && !__atomic_load_n(&node->loadFailed, __ATOMIC_RELAXED) ) {
+	    data = slot_data(cache, node);
+	    *size = node->size;
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if ( __atomic_load_n(&shard->seq, __ATOMIC_RELAXED) == seq )
+	    return data;
+    }
+}
+
+/* @param: shard: shard whose index is about to change, locked by the caller.
+ * Notes:
+ * Makes the shard's seq odd, so that index_read() retries whatever it finds until the change is
+ * done and index_write_end() makes it even again. Only an index_add() or index_del() takes the
+ * seqlock: a slot's name and hash only change while it is out of the index.
+ */
+static void index_write_begin(struct __cache_shard *shard)
+{
+    __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* @param: shard: shard whose index has changed, locked by the caller.
+ */
+static void index_write_end(struct __cache_shard *shard)
+{
+    __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   shard: shard owning the slot.
+ *   slot: slot number whose name and hash are already set.
+ * Notes:
+ * Adds the slot at the head of its bucket chain.
+ */
+static void index_add(file_cache *cache, struct __cache_shard *shard, int slot)
+{
+    int *bucket = &shard->hashHead[cache->nodeHead[slot].hash & shard->hashMask];
+
+    index_write_begin(shard);
+    __atomic_store_n(&cache->nodeHead[slot].hnext, *bucket, __ATOMIC_RELAXED);
+    __atomic_store_n(bucket, slot, __ATOMIC_RELAXED);
+    index_write_end(shard);
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   shard: shard owning the slot.
+ *   slot: slot number to unlink from its bucket chain.
+ */
+static void index_del(file_cache *cache, struct __cache_shard *shard, int slot)
+{
+    int *link = &shard->hashHead[cache->nodeHead[slot].hash & shard->hashMask];
+
+    while ( *link >= 0 ) {
+	if ( *link == slot ) {
+	    index_write_begin(shard);
+	    __atomic_store_n(link, cache->nodeHead[slot].hnext, __ATOMIC_RELAXED);
+	    __atomic_store_n(&cache->nodeHead[slot].hnext, -1, __ATOMIC_RELAXED);
+	    index_write_end(shard);
+	    return;
+	}
+	link = &cache->nodeHead[*link].hnext;
+    }
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   head, tail: the list, either the LRU or the dirty list of a shard.
+ *   slot: slot to append.
+ * Notes:
+ * Appends the slot at the tail (newest end) of the list.
+ */
+static void list_add(file_cache *cache, int *head, int *tail, int slot)
+{
+    struct __node_cache *node = &cache->nodeHead[slot];
+
+    node->lruNext = -1;
+    node->lruPrev = *tail;
+    if ( *tail >= 0 )
+	cache->nodeHead[*tail].lruNext = slot;
+    else
+	*head = slot;
+    *tail = slot;
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   head, tail: the list the slot is on.
+ *   slot: slot to unlink.
+ */
+static void list_del(file_cache *cache, int *head, int *tail, int slot)
+{
+    struct __node_cache *node = &cache->nodeHead[slot];
+
+    if ( node->lruPrev >= 0 )
+	cache->nodeHead[node->lruPrev].lruNext = node->lruNext;
+    else
+	*head = node->lruNext;
+    if ( node->lruNext >= 0 )
+	cache->nodeHead[node->lruNext].lruPrev = node->lruPrev;
+    else
+	*tail = node->lruPrev;
+    node->lruPrev = node->lruNext = -1;
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   shard: shard owning the slot.
+ *   slot: clean slot that just got unpinned.
+ * Notes:
+ * Appends the slot at the tail (most recently used end) of the LRU list, where it can be evicted.
+ * Under FILE_CACHE_POLICY_SLRU a hot slot goes on the protected list instead, pushing its oldest
+ * slot back onto the LRU list if that makes it too long.
+ */
+static void lru_add(file_cache *cache, struct __cache_shard *shard, int slot)
+{
+    if ( FILE_CACHE_POLICY_SLRU == cache->policy && cache->nodeHead[slot].hot ) {
+	list_add(cache, &shard->protHead, &shard->protTail, slot);
+	cache->nodeHead[slot].onList = FC_LIST_PROT;
+	if ( ++shard->protSize <= shard->protMax )
+	    return;
+	slot = shard->protHead;
+	list_del(cache, &shard->protHead, &shard->protTail, slot);
+	shard->protSize -= 1;
+	cache->nodeHead[slot].hot = 0;   /* Has to be hit again to get back */
+    }
+    list_add(cache, &shard->lruHead, &shard->lruTail, slot);
+    cache->nodeHead[slot].onList = FC_LIST_LRU;
+    shard->lruSize += 1;
+}
+
+/* @param: node: slot to check.
+ * @ret: 1 if the slot is on the LRU or the protected list, i.e. clean, unpinned and evictable.
+ */
+static int slot_evictable(const struct __node_cache *node)
+{
+    return FC_LIST_LRU == node->onList || FC_LIST_PROT == node->onList;
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   shard: shard owning the slot.
+ *   slot: dirty slot that just got unpinned.
+ * Notes:
+ * Appends the slot to the dirty list for the flusher.
+ * @ret: number of dirty unpinned slots in the whole cache, including this one.
+ */
+static int dirty_add(file_cache *cache, struct __cache_shard *shard, int slot)
+{
+    list_add(cache, &shard->dirtyHead, &shard->dirtyTail, slot);
+    cache->nodeHead[slot].onList = FC_LIST_DIRTY;
+    shard->dirtySize += 1;
+    return __atomic_add_fetch(&cache->dirtySize, 1, __ATOMIC_RELAXED);
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   shard: shard owning the slot.
+ *   slot: slot to take off whichever list it is on, because it gets pinned, evicted or flushed.
+ */
+static void slot_unlist(file_cache *cache, struct __cache_shard *shard, int slot)
+{
+    struct __node_cache *node = &cache->nodeHead[slot];
+
+    if ( FC_LIST_LRU == node->onList ) {
+	list_del(cache, &shard->lruHead, &shard->lruTail, slot);
+	shard->lruSize -= 1;
+    }
+    else if ( FC_LIST_PROT == node->onList ) {
+	list_del(cache, &shard->protHead, &shard->protTail, slot);
+	shard->protSize -= 1;
+    }
+    else if ( FC_LIST_DIRTY == node->onList ) {
+	list_del(cache, &shard->dirtyHead, &shard->dirtyTail, slot);
+	shard->dirtySize -= 1;
+	__atomic_sub_fetch(&cache->dirtySize, 1, __ATOMIC_RELAXED);
+    }
+    node->onList = 0;
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   shard: shard owning the slot.
+ *   slot: slot with no file in it.
+ */
+static void free_push(file_cache *cache, struct __cache_shard *shard, int slot)
+{
+    cache->nodeHead[slot].lruNext = shard->freeHead;
+    cache->nodeHead[slot].onList = FC_LIST_FREE;
+    shard->freeHead = slot;
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   shard: shard with a non empty free list.
+ * @ret: the free slot taken off the list.
+ */
+static int free_pop(file_cache *cache, struct __cache_shard *shard)
+{
+    int slot = shard->freeHead;
+
+    shard->freeHead = cache->nodeHead[slot].lruNext;
+    cache->nodeHead[slot].lruNext = -1;
+    cache->nodeHead[slot].onList = 0;
+    return slot;
+}
+
+/* @param: node: slot to clear, its buffer already freed.
+ * Notes:
+ * Clears the state of the slot. Its name buffer stays with it for the next file it holds.
+ */
+static void slot_reset(struct __node_cache *node)
+{
+    char *name = node->name;
+
+    memset(node, 0, sizeof(struct __node_cache));
+    node->name = name;
+    node->hnext = node->lruPrev = node->lruNext = -1;
+    node->fd = -1;
+}
+
+/* @param: shard: shard owning the slot, locked by the caller.
+ *   node: free slot about to hold the file.
+ *   name: name of the file.
+ * @ret: 0 on success, -1 if the name buffer can't be grown.
+ * Notes:
+ * Copies the name into the slot's name buffer, moving to one of the next power of 2 if too small.
+ * The outgrown buffer goes on the shard's retiredNames rather than back to malloc: index_read()
+ * may still be comparing against it, and must never read freed memory.
+ */
+static int slot_set_name(struct __cache_shard *shard, struct __node_cache *node, const char *name)
+{
+    int len = strlen(name) + 1, cap;
+    struct __name_buf *buf;
+
+    if ( !node->name || len > NAME_BUF(node->name)->cap ) {
+	for ( cap = FC_NAME_MIN; cap < len; cap <<= 1 )
+	    ;
+	buf = malloc(sizeof(struct __name_buf) + cap);
+	if ( !buf )
+	    return -1;
+	buf->cap = cap;
+	buf->next = NULL;
+	if ( node->name ) {
+	    NAME_BUF(node->name)->next = shard->retiredNames;
+	    shard->retiredNames = NAME_BUF(node->name);
+	}
+	__atomic_store_n(&node->name, buf->name, __ATOMIC_RELAXED);
+    }
+    memcpy(node->name, name, len);
+    __atomic_store_n(&node->nameLen, len - 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Header of a free block, kept in the first bytes of the block itself */
+struct __free_block {
+    int next;               /* Next free block of the same order, in units from the shard's arena. -1 at the end */
+    int prev;               /* Previous one, -1 at the head */
+};
+
+#define FREE_BLOCK(shard, off) ((struct __free_block *) ((shard)->arena + ((size_t) (off) << FC_BLOCK_SHIFT)))
+
+/* @param: cache: pointer to file_cache structure.
+ *   size: bytes of file data.
+ * @ret: number of FC_MIN_BLOCK units of the buffer holding them, at least one. With
+ *   file_cache_conf.padTo10Kb a buffer is never smaller than CACHE_SIZE, the 10Kb every file used
+ *   to get, so a caller written against that contract can't write past a shorter file's buffer
+ *   into another slot's.
+ */
+static int units_of(const file_cache *cache, size_t size)
+{
+    if ( cache->padTo10Kb && size < CACHE_SIZE )
+	size = CACHE_SIZE;
+    if ( 0 == size )
+	size = 1;
+    return (int) ((size + FC_MIN_BLOCK - 1) >> FC_BLOCK_SHIFT);
+}
+
+/* @param: shard: shard owning the block, locked by the caller.
+ *   off: block offset in units.
+ *   order: block order, it spans 1 << order units.
+ */
+static void block_push(struct __cache_shard *shard, int off, int order)
+{
+    struct __free_block *blk = FREE_BLOCK(shard, off);
+
+    blk->prev = -1;
+    blk->next = shard->freeBlock[order];
+    if ( blk->next >= 0 )
+	FREE_BLOCK(shard, blk->next)->prev = off;
+    shard->freeBlock[order] = off;
+    shard->blockOrder[off] = order + 1;
+}
+
+static void block_unlink(struct __cache_shard *shard, int off, int order)
+{
+    struct __free_block *blk = FREE_BLOCK(shard, off);
+
+    if ( blk->prev >= 0 )
+	FREE_BLOCK(shard, blk->prev)->next = blk->next;
+    else
+	shard->freeBlock[order] = blk->next;
+    if ( blk->next >= 0 )
+	FREE_BLOCK(shard, blk->next)->prev = blk->prev;
+    shard->blockOrder[off] = 0;
+}
+
+/* @param: shard: shard owning the range, locked by the caller.
+ *   off, units: range of units to free.
+ * Notes:
+ * Frees the range as the largest aligned blocks that tile it, each merged with its buddy for as
+ * long as the buddy is a free block of the same order.
+ */
+static void range_free(struct __cache_shard *shard, int off, int units)
+{
+    int end = off + units, cur = off, order, blk, buddy;
+
+    while ( cur < end ) {
+	/* Largest block aligned at cur that doesn't run past end */
+	for ( order = 0; order < shard->maxOrder && !(cur & (1 << order)) && cur + (2 << order) <= end; order++ )
+	    ;
+	blk = cur;
+	cur += 1 << order;
+	for ( ; order < shard->maxOrder; order++ ) {
+	    buddy = blk ^ (1 << order);
+	    if ( buddy + (1 << order) > shard->arenaUnits || shard->blockOrder[buddy] != order + 1 )
+		break;
+	    block_unlink(shard, buddy, order);
+	    if ( buddy < blk )
+		blk = buddy;
+	}
+	block_push(shard, blk, order);
+    }
+}
+
+/* @param: shard: shard to allocate from, locked by the caller.
+ *   units: units needed.
+ * @ret: offset of the range in units, -1 if no run of free blocks is that long.
+ * Notes:
+ * Walks the arena for the first run of adjacent free blocks spanning 'units', whatever their
+ * orders, takes them and gives the part past 'units' back. Used when no single block is big
+ * enough, as an aligned block can be missing while the free space around the buffers isn't.
+ */
+static int range_alloc_run(struct __cache_shard *shard, int units)
+{
+    int off, start = 0, len = 0, order;
+
+    for ( off = 0; off < shard->arenaUnits && len < units; ) {
+	if ( shard->blockOrder[off] ) {  /* a free block starts here */
+	    if ( 0 == len )
+		start = off;
+	    len += 1 << (shard->blockOrder[off] - 1);
+	    off += 1 << (shard->blockOrder[off] - 1);
+	}
+	else {
+	    len = 0;
+	    off++;
+	}
+    }
+    if ( len < units )
+	return -1;
+    for ( off = start; off < start + len; off += 1 << order ) {
+	order = shard->blockOrder[off] - 1;
+	block_unlink(shard, off, order);
+    }
+    if ( len > units )
+	range_free(shard, start + units, len - units);
+    return start;
+}
+
+/* @param: shard: shard to allocate from, locked by the caller.
+ *   units: units needed.
+ * @ret: offset of the range in units, -1 if the shard has no free range that long.
+ * Notes:
+ * Splits the smallest free block of at least the next power of 2 units, and gives the part of it
+ * past 'units' straight back, so a buffer wastes less than FC_MIN_BLOCK bytes. Without such a
+ * block, and with enough units free all told, it falls back to range_alloc_run().
+ */
+static int range_alloc(struct __cache_shard *shard, int units)
+{
+    int order, want, off;
+
+    for ( want = 0; (1 << want) < units; want++ )
+	;
+    for ( order = want; order <= shard->maxOrder && shard->freeBlock[order] < 0; order++ )
+	;
+    if ( order > shard->maxOrder ) {
+	if ( (size_t) units > shard->arenaUnits - (shard->usedBytes >> FC_BLOCK_SHIFT) )
+	    return -1;
+	return range_alloc_run(shard, units);
+    }
+    off = shard->freeBlock[order];
+    block_unlink(shard, off, order);
+    while ( order > want ) {  /* keep the lower half, free the upper one */
+	order--;
+	block_push(shard, off + (1 << order), order);
+    }
+    if ( units < (1 << want) )
+	range_free(shard, off + units, (1 << want) - units);
+    return off;
+}
+
+/* @param: size: bytes of file data.
+ * @ret: bytes a FILE_CACHE_MODE_MMAP slot charges to its shard for a mapping of them.
+ */
+static size_t map_bytes(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    return size ? (size + page - 1) & ~(page - 1) : page;
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   shard: shard of the file.
+ *   size: bytes of the file.
+ * @ret: 1 if a file of this size can be cached in the shard at all, 0 if it is too big.
+ */
+static int buf_fits(file_cache *cache, struct __cache_shard *shard, size_t size)
+{
+    if ( FILE_CACHE_MODE_MMAP == cache->mode )
+	return map_bytes(size) <= shard->maxBytes;
+    return (size_t) units_of(cache, size) <= (size_t) shard->arenaUnits;
+}
+
+/* @param: size: bytes of a file.
+ * @ret: log2 of the granule one bit of the slot's dirtyMap stands for. 512 bytes for files up to
+ * 128Kb, 4Kb up to 1Mb, and beyond that the smallest power of 2 that keeps the map at 256 bits.
+ */
+static unsigned char dirty_shift(size_t size)
+{
+    unsigned char shift = FC_BLOCK_SHIFT;
+
+    if ( size > ((size_t) FC_DIRTY_WORDS * 64) << shift )
+	shift = 12;
+    while ( size > ((size_t) FC_DIRTY_WORDS * 64) << shift )
+	shift++;
+    return shift;
+}
+
+/* @param: node: loaded slot, its shard locked by the caller.
+ *   offset, len: bytes of the file written to, clipped to its size.
+ * Notes:
+ * Sets the dirty byte and the bits of dirtyMap covering the range, so writeback rewrites only them.
+ */
+static void dirty_mark(struct __node_cache *node, size_t offset, size_t len)
+{
+    size_t first, last;
+
+    node->dirty = 1;
+    if ( offset >= node->size || 0 == len )
+	return;
+    if ( len > node->size - offset )
+	len = node->size - offset;
+    first = offset >> node->dirtyShift;
+    last = (offset + len - 1) >> node->dirtyShift;
+    for ( ; first <= last; first++ )
+	node->dirtyMap[first / 64] |= 1ULL << (first % 64);
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   shard: shard owning the slot, locked by the caller.
+ *   node: free slot about to hold the file.
+ *   size: bytes of the file.
+ * @ret: 0 if the space is taken, -1 if the shard has no room for it left.
+ * Notes:
+ * In FILE_CACHE_MODE_COPY this allocates the slot's buffer from the shard's arena, in whole
+ * FC_MIN_BLOCK units, see units_of(). In FILE_CACHE_MODE_MMAP the load maps the file later, and
+ * only its bytes are charged to the shard.
+ */
+static int buf_alloc(file_cache *cache, struct __cache_shard *shard, struct __node_cache *node, size_t size)
+{
+    int off;
+
+    if ( FILE_CACHE_MODE_MMAP == cache->mode ) {
+	if ( shard->usedBytes + map_bytes(size) > shard->maxBytes )
+	    return -1;
+	shard->usedBytes += map_bytes(size);
+    }
+    else {
+	off = range_alloc(shard, units_of(cache, size));
+	if ( off < 0 )
+	    return -1;
+	node->cache = shard->arena + ((size_t) off << FC_BLOCK_SHIFT);
+	shard->usedBytes += (size_t) units_of(cache, size) << FC_BLOCK_SHIFT;
+	if ( cache->padTo10Kb && size < CACHE_SIZE )  /* the tail past the file reads as zeros, as it used to */
+	    memset(node->cache + size, 0, CACHE_SIZE - size);
+    }
+    node->size = size;
+    node->dirtyShift = dirty_shift(size);
+    return 0;
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   shard: shard owning the slot, locked by the caller.
+ *   node: slot giving up its space, taken by buf_alloc().
+ */
+static void buf_free(file_cache *cache, struct __cache_shard *shard, struct __node_cache *node)
+{
+    if ( FILE_CACHE_MODE_MMAP == cache->mode ) {
+	if ( node->cache && node->cache != cache->zeroBuf )
+	    munmap(node->cache, node->size);
+	shard->usedBytes -= map_bytes(node->size);
+    }
+    else {
+	range_free(shard, (node->cache - shard->arena) >> FC_BLOCK_SHIFT, units_of(cache, node->size));
+	shard->usedBytes -= (size_t) units_of(cache, node->size) << FC_BLOCK_SHIFT;
+    }
+    node->cache = NULL;
+    node->size = 0;
+}
+
+/* @param: name: file to open.
+ * @ret: descriptor of the file, O_RDWR so that it can serve the writeback as well, or O_RDONLY
+ *       if the file isn't writable. -1 if it can't be opened.
+ */
+static int file_open(const char *name)
+{
+    int fd;
+
+    fd = open(name, O_RDWR);
+    if ( fd < 0 && (EACCES == errno || EROFS == errno) )
+	fd = open(name, O_RDONLY);
+    return fd;
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   node: slot just loaded from fd.
+ *   fd: descriptor the slot was read through.
+ * Notes:
+ * Keeps fd open in the slot for its later writebacks and reloads, as long as fewer than
+ * maxOpenFds descriptors are kept across the cache. Otherwise it is closed.
+ */
+static void slot_keep_fd(file_cache *cache, struct __node_cache *node, int fd)
+{
+    if ( __atomic_add_fetch(&cache->openFds, 1, __ATOMIC_RELAXED) <= cache->maxOpenFds ) {
+	node->fd = fd;
+	return;
+    }
+    __atomic_sub_fetch(&cache->openFds, 1, __ATOMIC_RELAXED);
+    close(fd);
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   node: slot being dropped.
+ */
+static void slot_close_fd(file_cache *cache, struct __node_cache *node)
+{
+    if ( node->fd < 0 )
+	return;
+    close(node->fd);
+    node->fd = -1;
+    __atomic_sub_fetch(&cache->openFds, 1, __ATOMIC_RELAXED);
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   shard: shard owning the slot, locked by the caller.
+ *   slot: clean unpinned slot on the LRU (or protected) list.
+ *
+ * Notes:
+ * Drops the slot from the index and its list onto the free list, and gives its buffer back to
+ * the shard. Only clean slots are on the LRU and protected lists so there is nothing to write back.
+ */
+static void evict_slot(file_cache *cache, struct __cache_shard *shard, int slot)
+{
+    struct __node_cache *node = &cache->nodeHead[slot];
+
+    dbug_p("EVICTING:%s:\n", node->name);
+    slot_unlist(cache, shard, slot);
+    index_del(cache, shard, slot);
+    buf_free(cache, shard, node);
+    slot_close_fd(cache, node);
+    slot_reset(node);
+    free_push(cache, shard, slot);
+    shard->currentSize -= 1;
+    shard->stats.evictions++;
+}
+
+/* @param: fd: file open for reading.
+ *   buf: buffer to fill.
+ *   got: bytes of buf already read from the start of the file.
+ *   size: bytes to read.
+ * @ret: 0 on success, -1 on a read error.
+ * Notes:
+ * Reads the rest of the first 'size' bytes, and zeroes what is left if the file has shrunk.
+ */
+static int fd_read(int fd, char *buf, size_t got, size_t size)
+{
+    ssize_t n;
+
+    while ( got < size ) {
+	n = pread(fd, buf + got, size - got, got);
+	if ( n < 0 && EINTR == errno )
+	    continue;
+	if ( n < 0 )
+	    return -1;
+	if ( 0 == n )
+	    break;
+	got += n;
+    }
+    memset(buf + got, 0, size - got);
+    return 0;
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   node: claimed slot, its name, size and (in FILE_CACHE_MODE_COPY) buffer already set.
+ *   fd: the file, opened by the pin that claimed the slot.
+ * @ret: 0 if the file was loaded into the slot, -1 on error.
+ *
+ * Notes:
+ * Fills the slot's cache buffer: read into the arena buffer in FILE_CACHE_MODE_COPY, mapped
+ * MAP_SHARED in FILE_CACHE_MODE_MMAP. Runs without the shard lock, the slot is held by
+ * its 'loading' pin. In FILE_CACHE_MODE_COPY the descriptor stays with the slot if the
+ * budget allows, the mapping needs none.
+ */
+static int slot_load(file_cache *cache, struct __node_cache *node, int fd)
+{
+    void *map;
+    int ret;
+
+    if ( FILE_CACHE_MODE_MMAP == cache->mode ) {
+	if ( 0 == node->size ) {             /* Nothing to map, a mapping past EOF would fault */
+	    close(fd);
+	    node->cache = (char *) cache->zeroBuf;
+	    return cache->zeroBuf ? 0 : -1;
+	}
+	node->readOnly = O_RDONLY == (fcntl(fd, F_GETFL) & O_ACCMODE);   /* see file_open() */
+	map = mmap(NULL, node->size, node->readOnly ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);                           /* the mapping keeps the file referenced */
+	if ( MAP_FAILED == map )
+	    return -1;
+	node->cache = map;
+	return 0;
+    }
+
+    ret = fd_read(fd, node->cache, 0, node->size);   /* Read file into the cache */
+    if ( ret )
+	close(fd);
+    else
+	slot_keep_fd(cache, node, fd);
+    return ret;
+}
+
+/* @param: buf, size: bytes to look at.
+ * @ret: 1 if all of them are zero.
+ */
+static int buf_is_zero(const char *buf, size_t size)
+{
+    return 0 == size || (0 == buf[0] && 0 == memcmp(buf, buf + 1, size - 1));
+}
+
+/* @param: node: loaded slot whose data is all zero, FILE_CACHE_MODE_COPY.
+ *
+ * Notes:
+ * Points the slot's readers at the shared zeroBuf and gives the pages inside its own buffer back
+ * to the kernel. The buffer stays allocated to the slot, so the copy made on the first write
+ * needs no room and can't fail.
+ */
+static void slot_zero(struct __node_cache *node)
+{
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t) node->cache + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t) node->cache + node->size) & ~(page - 1);
+
+    node->zero = 1;
+    if ( start < end )
+	madvise((void *) start, end - start, MADV_DONTNEED);
+}
+
+/* @param: start: CLOCK_MONOTONIC time taken when the timed operation began.
+ * @ret: microseconds since start.
+ */
+static unsigned long long usec_since(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000ULL + now.tv_nsec / 1000 - start->tv_nsec / 1000;
+}
+
+/* @param: hist: FC_HIST_BUCKETS counters, see struct file_cache_stats.
+ *   usec: duration to count, in the bucket of its log2. The last bucket takes everything longer.
+ */
+static void hist_add(unsigned long long *hist, unsigned long long usec)
+{
+    int b = usec ? 63 - __builtin_clzll(usec) : 0;
+
+    hist[b < FC_HIST_BUCKETS ? b : FC_HIST_BUCKETS - 1]++;
+}
+
+/* @param: node: slot being written back.
+ *   map: snapshot of the slot's dirtyMap.
+ *   next: granule to look from, moved past the run found.
+ *   start, end: set to the byte range of the run, clipped to the file.
+ * @ret: 1 if a run of dirty granules was found at or after 'next', 0 if there is none left.
+ */
+static int dirty_run(const struct __node_cache *node, const unsigned long long *map, size_t *next,
+		     size_t *start, size_t *end)
+{
+    size_t bits = (node->size + ((size_t) 1 << node->dirtyShift) - 1) >> node->dirtyShift;
+    size_t first, last;
+
+    for ( first = *next; first < bits && !(map[first / 64] & (1ULL << (first % 64))); first++ )
+	;
+    if ( first >= bits )
+	return 0;
+    for ( last = first + 1; last < bits && (map[last / 64] & (1ULL << (last % 64))); last++ )
+	;
+    *next = last;
+    *start = first << node->dirtyShift;
+    *end = last << node->dirtyShift;
+    if ( *end > node->size )
+	*end = node->size;
+    return 1;
+}
+
+static unsigned int crc32cTable[256];   /* Software CRC32C, one byte at a time */
+static pthread_once_t crc32cOnce = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void)
+{
+    unsigned int c;
+    int i, k;
+
+    for ( i = 0; i < 256; i++ ) {
+	for ( c = i, k = 0; k < 8; k++ )
+	    c = c & 1 ? (c >> 1) ^ FC_CRC32C_POLY : c >> 1;
+	crc32cTable[i] = c;
+    }
+}
+
+#ifdef FC_HAVE_CRC32C_SSE42
+/* The crc32 instruction of SSE4.2, 8 bytes at a time. Only called once the CPU is known to have it */
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_sse42(unsigned int crc, const unsigned char *p, size_t len)
+{
+    unsigned long long c = crc;
+    unsigned long long word;
+
+    for ( ; len >= 8; p += 8, len -= 8 ) {
+	memcpy(&word, p, 8);
+	c = _mm_crc32_u64(c, word);
+    }
+    for ( crc = c; len; len-- )
+	crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+/* @param: crc: CRC32C of the bytes before buf, 0 to start.
+ *   buf, len: bytes to checksum.
+ * @ret: the CRC32C carried on over the 'len' bytes at buf.
+ * Notes:
+ * Uses the CPU's crc32 instruction where it has one, a table otherwise.
+ */
+static unsigned int crc32c_carry(unsigned int crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    crc = ~crc;
+#ifdef FC_HAVE_CRC32C_SSE42
+    if ( __builtin_cpu_supports("sse4.2") )
+	return ~crc32c_sse42(crc, p, len);
+#endif
+    pthread_once(&crc32cOnce, crc32c_init);
+    while ( len-- )
+	crc = crc32cTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+/* @param: buf, len: bytes to checksum.
+ * @ret: their CRC32C.
+ */
+static unsigned int crc32c(const void *buf, size_t len)
+{
+    return crc32c_carry(0, buf, len);
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   node: slot to write, held by its 'flushing' mark.
+ *   map: snapshot of the slot's dirtyMap taken when the flush started.
+ *   written: set to the bytes written (or synced).
+ *   sync: 1 to fdatasync() the file once written.
+ * @ret: 0 on success, -1 if the file can't be written (or synced).
+ * Notes:
+ * Writes each run of dirty granules in map with one pwrite() through the slot's kept descriptor,
+ * or through one opened just for this write if it has none (or only a read-only one). The rest of
+ * the file is left alone. In FILE_CACHE_MODE_MMAP the cache buffer is the file's own mapping and
+ * each run only needs an msync(), which is synchronous already. A sync costs one fdatasync() for
+ * all the runs of the file.
+ */
+static int write_back(file_cache *cache, struct __node_cache *node, const unsigned long long *map,
+		      size_t *written, int sync)
+{
+    size_t next = 0, done, end;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    ssize_t n;
+    int fd = node->fd, own = 0, ret = 0;
+
+    *written = 0;
+    while ( !ret && dirty_run(node, map, &next, &done, &end) ) {
+	if ( FILE_CACHE_MODE_MMAP == cache->mode ) {
+	    done &= ~(page - 1);   /* msync() wants a page aligned start, the mapping is page aligned */
+	    if ( msync(node->cache + done, end - done, MS_SYNC) )
+		ret = -1;
+	    else
+		*written += end - done;
+	    continue;
+	}
+	if ( fd < 0 ) {
+	    fd = open(node->name, O_WRONLY | O_CREAT, 0666);
+	    if ( fd < 0 )
+		return -1;
+	    own = 1;
+	}
+	while ( done < end ) {
+	    n = pwrite(fd, node->cache + done, end - done, done);
+	    if ( n < 0 && EINTR == errno )
+		continue;
+	    if ( n < 0 && EBADF == errno && !own ) { /* kept read-only, the file may be writable by now */
+		fd = open(node->name, O_WRONLY | O_CREAT, 0666);
+		if ( fd < 0 )
+		    return -1;
+		own = 1;
+		continue;
+	    }
+	    if ( n <= 0 )
+		break;
+	    done += n;
+	    *written += n;
+	}
+	if ( done != end )
+	    ret = -1;
+    }
+    if ( sync && !ret && fd >= 0 && fdatasync(fd) )
+	ret = -1;
+    if ( own )
+	close(fd);
+    return ret;
+}
+
+/* Header of a record of the write log. The name of the file, with no '\0', and the data follow it */
+struct __log_rec {
+    unsigned int magic;          /* FC_LOG_MAGIC */
+    unsigned int check;          /* CRC32C of the header (with check 0), the name and the data */
+    unsigned int nameLen;        /* Bytes of name */
+    unsigned int pad;
+    unsigned long long offset;   /* Where the data goes in the file */
+    unsigned long long len;      /* Bytes of data */
+};
+
+/* @param: cache: pointer to file_cache structure, with a write log.
+ *   node: slot to write, held by its 'flushing' mark.
+ *   map: snapshot of the slot's dirtyMap taken when the flush started.
+ * @ret: 0 once every dirty run of the slot is appended to the log, -1 on a write error.
+ * Notes:
+ * Appends a record per run at logSize. Only the flusher appends, so the log needs no lock of its
+ * own. A failed append cuts the log back to where the slot's records started, so that the log
+ * always ends with a whole record. Nothing is synced here, see flusher_main().
+ */
+static int log_append(file_cache *cache, struct __node_cache *node, const unsigned long long *map)
+{
+    struct __log_rec rec;
+    struct iovec iov[3];
+    size_t next = 0, start, end, at = cache->logSize;
+    ssize_t n;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = FC_LOG_MAGIC;
+    rec.nameLen = strlen(node->name);
+    while ( dirty_run(node, map, &next, &start, &end) ) {
+	rec.check = 0;
+	rec.offset = start;
+	rec.len = end - start;
+	rec.check = crc32c_carry(crc32c_carry(crc32c(&rec, sizeof(rec)), node->name, rec.nameLen),
+				 node->cache + start, rec.len);
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = node->name;
+	iov[1].iov_len = rec.nameLen;
+	iov[2].iov_base = node->cache + start;
+	iov[2].iov_len = rec.len;
+	do
+	    n = pwritev(cache->logFd, iov, 3, at);
+	while ( n < 0 && EINTR == errno );
+	if ( n != (ssize_t) (sizeof(rec) + rec.nameLen + rec.len) ) {
+	    if ( ftruncate(cache->logFd, cache->logSize) )
+		dbug_p("can't cut the write log back\n");
+	    return -1;
+	}
+	at += n;
+    }
+    cache->logSize = at;
+    cache->logUnsynced = 1;
+    return 0;
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* @param: cache: pointer to file_cache structure, with a write log.
+ *   apply: 1 to write the data of every record to its file, as when replaying the log of a previous
+ *     run at construction. 0 at a checkpoint, the flusher has written it in place already.
+ * @ret: 0 once the log is applied and emptied, -1 if a file couldn't be written or synced, in which
+ *   case the log is kept as it is.
+ *
+ * Notes:
+ * Reads the records from the start of the log up to the first one that is torn or doesn't match
+ * its check, i.e. a tail a crash cut short, which was never acknowledged. Each file named is
+ * fdatasync()ed once, then the log is truncated and synced empty.
+ */
+static int log_checkpoint(file_cache *cache, int apply)
+{
+    struct __log_rec rec;
+    struct stat st;
+    char **names = NULL, **grown, *data = NULL, *buf;
+    size_t pos, end, dataCap = 0, done;
+    unsigned int check;
+    ssize_t n;
+    int i, j, num = 0, cap = 0, fd, ret = 0;
+
+    if ( fstat(cache->logFd, &st) )
+	return -1;
+    end = st.st_size;
+    for ( pos = 0; !ret && pos + sizeof(rec) <= end; pos += sizeof(rec) + rec.nameLen + rec.len ) {
+	if ( pread(cache->logFd, &rec, sizeof(rec), pos) != (ssize_t) sizeof(rec) || FC_LOG_MAGIC != rec.magic
+	     || 0 == rec.nameLen || rec.nameLen > FC_LOG_NAME_MAX
+	     || rec.nameLen > end - pos - sizeof(rec) || rec.len > end - pos - sizeof(rec) - rec.nameLen )
+	    break;
+	if ( num == cap ) {
+	    cap = cap ? 2 * cap : 64;
+	    grown = realloc(names, cap * sizeof(char *));
+	    if ( !grown ) {
+		ret = -1;
+		break;
+	    }
+	    names = grown;
+	}
+	names[num] = malloc(rec.nameLen + 1);
+	if ( !names[num] ) {
+	    ret = -1;
+	    break;
+	}
+	if ( pread(cache->logFd, names[num], rec.nameLen, pos + sizeof(rec)) != (ssize_t) rec.nameLen ) {
+	    free(names[num]);
+	    break;
+	}
+	names[num][rec.nameLen] = '\0';
+	if ( !apply ) {
+	    num++;
+	    continue;
+	}
+
+	if ( rec.len > dataCap ) {
+	    buf = realloc(data, rec.len);
+	    if ( !buf ) {
+		free(names[num]);
+		ret = -1;
+		break;
+	    }
+	    data = buf;
+	    dataCap = rec.len;
+	}
+	check = rec.check;
+	rec.check = 0;
+	if ( pread(cache->logFd, data, rec.len, pos + sizeof(rec) + rec.nameLen) != (ssize_t) rec.len
+	     || check != crc32c_carry(crc32c_carry(crc32c(&rec, sizeof(rec)), names[num], rec.nameLen),
+				      data, rec.len) ) {
+	    free(names[num]);
+	    break;
+	}
+	fd = open(names[num], O_WRONLY | O_CREAT, 0666);
+	for ( done = 0; fd >= 0 && done < rec.len; done += n ) {
+	    n = pwrite(fd, data + done, rec.len - done, rec.offset + done);
+	    if ( n < 0 && EINTR == errno )
+		n = 0;
+	    else if ( n <= 0 )
+		break;
+	}
+	if ( fd < 0 || done < rec.len )
+	    ret = -1;
+	if ( fd >= 0 )
+	    close(fd);
+	num++;
+    }
+    free(data);
+
+    /* One sync per file, however many records it has */
+    if ( num > 0 )
+	qsort(names, num, sizeof(char *), name_cmp);
+    for ( i = 0; i < num; i++ ) {
+	for ( j = i + 1; j < num && !strcmp(names[i], names[j]); j++ )
+	    ;
+	fd = open(names[i], O_RDONLY);
+	if ( fd >= 0 ) {
+	    if ( !ret && fdatasync(fd) )
+		ret = -1;
+	    close(fd);
+	}
+	else if ( ENOENT != errno )            /* A file removed since has nothing left to sync */
+	    ret = -1;
+	while ( i < j - 1 )
+	    free(names[i++]);
+	free(names[i]);
+    }
+    free(names);
+
+    if ( ret || ftruncate(cache->logFd, 0) || fdatasync(cache->logFd) )
+	return -1;
+    cache->logSize = 0;
+    cache->logUnsynced = 0;
+    return 0;
+}
+
+/* A pin batch queued on a shard's admission queue, on the stack of the waiting thread */
+struct __admit {
+    pthread_cond_t cv;           /* Signaled once the slots are granted, only this waiter wakes */
+    int need;                    /* Slots asked for */
+    int granted;                 /* Set with the slots added to the shard's 'reserved' */
+    struct __admit *next;        /* Next waiter, in arrival order */
+};
+
+/* @param: shard: shard, locked by the caller.
+ * @ret: slots a new reservation may still take: free or evictable, and not promised to anyone.
+ */
+static int shard_room(struct __cache_shard *shard)
+{
+    return shard->maxSize - shard->currentSize + shard->lruSize + shard->protSize - shard->reserved;
+}
+
+/* @param: shard: shard whose room just grew, locked by the caller.
+ * Notes:
+ * Hands the room to the queued batches in arrival order, as long as the first in line fits, and
+ * wakes just those. A batch that doesn't fit yet holds up the ones behind it, so a large batch is
+ * never starved by a stream of small ones.
+ */
+static void admit_grant(struct __cache_shard *shard)
+{
+    struct __admit *a;
+
+    while ( (a = shard->admitHead) && shard_room(shard) >= a->need ) {
+	shard->admitHead = a->next;
+	if ( !shard->admitHead )
+	    shard->admitTail = NULL;
+	shard->reserved += a->need;
+	a->granted = 1;
+	pthread_cond_signal(&a->cv);
+    }
+}
+
+/* @param: cache: pointer to file_cache structure.
+ * Notes:
+ * Makes the flusher start a pass now rather than at the end of its interval.
+ */
+static void flusher_kick(file_cache *cache)
+{
+    if ( __atomic_load_n(&cache->flushKick, __ATOMIC_RELAXED) )
+	return;
+    pthread_mutex_lock(&cache->flushLock);
+    __atomic_store_n(&cache->flushKick, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&cache->flushcv);
+    pthread_mutex_unlock(&cache->flushLock);
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   shard: shard owning the slot, locked by the caller.
+ *   slot: dirty slot, pinned or on the dirty list.
+ *   sync: 1 to have the write on disk before it returns, see write_back(). With a write log the
+ *     slot is appended to the log and written in place unsynced, and the flusher syncs the log.
+ * @ret: 0 if written back, -1 on a write error. Returns with the shard locked again.
+ *
+ * Notes:
+ * The write itself runs without the shard lock. While it is in flight the slot is on no list and
+ * 'flushing' keeps unpin from putting it on one, so it can't be evicted from under the write.
+ * Afterwards an unpinned slot goes on the LRU list if still clean, or back on the dirty list if it
+ * was written to again (or the write failed). A slot still pinned is left dirty, with the granules
+ * just written still set in its map: its pinner may hold a mutable pointer and go on writing
+ * through it without asking for one again.
+ * In FILE_CACHE_MODE_COPY a slot whose CRC32C still matches the one taken when it was read in (or
+ * last written back) is not written at all, it was only made mutable. The CRC of a write the slot
+ * was dirtied again during is not trusted, as part of what it covers may not have been written.
+ */
+static int flush_slot(file_cache *cache, struct __cache_shard *shard, int slot, int sync)
+{
+    struct __node_cache *node = &cache->nodeHead[slot];
+    unsigned long long map[FC_DIRTY_WORDS];
+    struct timespec start;
+    size_t written;
+    unsigned int crc = 0;
+    int ret, i, unchanged = 0;
+
+    slot_unlist(cache, shard, slot);
+    node->flushing = 1;
+    node->dirty = 0;
+    memcpy(map, node->dirtyMap, sizeof(map));
+    memset(node->dirtyMap, 0, sizeof(map));
+    pthread_mutex_unlock(&shard->lock);
+
+    dbug_p("FLUSHING:%s:\n", node->name);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ( FILE_CACHE_MODE_COPY == cache->mode ) {
+	crc = crc32c(node->cache, node->size);
+	unchanged = node->crcValid && crc == node->crc;
+    }
+    if ( unchanged ) {               /* Made mutable but never written to, the file has it all */
+	written = 0;
+	ret = 0;
+    }
+    else if ( cache->logFd >= 0 ) {  /* Logged first, the log is synced for the whole pass */
+	written = 0;
+	ret = log_append(cache, node, map);
+	if ( !ret )
+	    ret = write_back(cache, node, map, &written, 0);
+    }
+    else
+	ret = write_back(cache, node, map, &written, sync);
+
+    pthread_mutex_lock(&shard->lock);
+    node->flushing = 0;
+    shard->stats.bytesWritten += written;
+    if ( !ret && unchanged )
+	shard->stats.unchangedFlushes++;
+    else if ( !ret ) {
+	node->crc = crc;
+	node->crcValid = !node->dirty;   /* Dirtied during the write, the file may not hold what crc covers */
+	shard->stats.writebacks++;
+	hist_add(shard->stats.flushLatency, usec_since(&start));
+    }
+    else
+	node->crcValid = 0;              /* Part of it may have been written */
+    if ( ret || node->refCount > 0 ) {
+	node->dirty = 1;
+	for ( i = 0; i < FC_DIRTY_WORDS; i++ )
+	    node->dirtyMap[i] |= map[i];
+    }
+    if ( 0 == node->refCount ) {
+	if ( node->dirty )
+	    dirty_add(cache, shard, slot);
+	else {
+	    lru_add(cache, shard, slot);
+	    admit_grant(shard);
+	    pthread_cond_broadcast(&shard->slotcv); /* Waiting pinners can evict it now */
+	}
+    }
+    return ret;
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   shard: shard to flush.
+ *   all: 0 to drain the dirty list, 1 to also write back dirty pinned slots (used by destroy and
+ *     file_cache_sync()).
+ *   sync: 1 to fdatasync() each file written.
+ * @ret: number of files that failed to write.
+ * Notes:
+ * A pass handles each slot on the dirty list at most once, so a file that keeps failing to write
+ * doesn't spin the flusher.
+ */
+static int flush_shard(file_cache *cache, struct __cache_shard *shard, int all, int sync)
+{
+    int n, slot, last, failed = 0;
+
+    pthread_mutex_lock(&shard->lock);
+    if ( all ) {
+	last = shard->firstSlot + shard->maxSize;
+	for ( slot = shard->firstSlot; slot < last; slot++ ) {
+	    if ( cache->nodeHead[slot].dirty && !cache->nodeHead[slot].flushing )
+		failed -= flush_slot(cache, shard, slot, sync);
+	}
+    }
+    else {
+	for ( n = shard->dirtySize; n > 0 && shard->dirtyHead >= 0; n-- )
+	    failed -= flush_slot(cache, shard, shard->dirtyHead, sync);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return failed;
+}
+
+/* @param: arg: the file_cache to flush.
+ * Notes:
+ * Body of the flusher thread. Runs a pass over every shard each flushIntervalMs, or earlier when
+ * kicked. Once flushStop is set it runs a last pass that also writes back pinned dirty slots and exits.
+ *
+ * file_cache_sync() bumps syncReq and kicks. The flusher then holds off for groupCommitUs, so that
+ * syncs from other threads arriving meanwhile join in, and runs one pass that writes back every
+ * dirty slot, pinned too, with an fdatasync() per file. At the end of the pass syncDone moves up
+ * to the syncReq it started from and all the syncs it covered are woken together. A sync called
+ * during a pass waits for the next one, as its data may be in a shard the pass is done with.
+ *
+ * With a write log a pass appends the dirty runs to the log and writes them in place unsynced, and
+ * where the pass has to sync it syncs the log alone, once. When the log has grown to logMax (and
+ * on the last pass) it checkpoints: every file in the log is synced and the log is emptied.
+ */
+static void *flusher_main(void *arg)
+{
+    file_cache *cache = (file_cache *) arg;
+    struct timespec deadline;
+    unsigned long target;
+    int i, stop, all, sync, failed;
+
+    pthread_mutex_lock(&cache->flushLock);
+    for ( ;; ) {
+	if ( !cache->flushKick && !cache->flushStop ) {
+	    if ( cache->flushIntervalMs > 0 ) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += cache->flushIntervalMs / 1000;
+		deadline.tv_nsec += (cache->flushIntervalMs % 1000) * 1000000L;
+		if ( deadline.tv_nsec >= 1000000000L ) {
+		    deadline.tv_sec += 1;
+		    deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&cache->flushcv, &cache->flushLock, &deadline);
+	    }
+	    else
+		pthread_cond_wait(&cache->flushcv, &cache->flushLock);
+	}
+	if ( cache->syncReq != cache->syncDone && !cache->flushStop && cache->groupCommitUs > 0 ) {
+	    clock_gettime(CLOCK_MONOTONIC, &deadline);   /* Group commit window */
+	    deadline.tv_nsec += cache->groupCommitUs % 1000000 * 1000L;
+	    deadline.tv_sec += cache->groupCommitUs / 1000000 + deadline.tv_nsec / 1000000000L;
+	    deadline.tv_nsec %= 1000000000L;
+	    while ( !cache->flushStop
+		    && ETIMEDOUT != pthread_cond_timedwait(&cache->flushcv, &cache->flushLock, &deadline) )
+		;
+	}
+	stop = cache->flushStop;
+	target = cache->syncReq;
+	sync = target != cache->syncDone || cache->durable;
+	all = stop || target != cache->syncDone;
+	__atomic_store_n(&cache->flushKick, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&cache->flushLock);
+
+	for ( i = 0, failed = 0; i < cache->numShards; i++ )
+	    failed += flush_shard(cache, &cache->shards[i], all, sync);
+	if ( cache->logFd >= 0 ) {
+	    if ( sync && cache->logUnsynced ) {
+		if ( fdatasync(cache->logFd) )
+		    failed++;
+		else
+		    cache->logUnsynced = 0;
+	    }
+	    if ( (stop || cache->logSize >= cache->logMax) && log_checkpoint(cache, 0) )
+		dbug_p("write log checkpoint failed, kept for the next one\n");
+	}
+
+	pthread_mutex_lock(&cache->flushLock);
+	if ( target != cache->syncDone ) {
+	    if ( failed )
+		cache->syncFailed = target;
+	    cache->syncDone = target;
+	    pthread_cond_broadcast(&cache->synccv);
+	}
+	if ( stop )
+	    break;
+    }
+    pthread_mutex_unlock(&cache->flushLock);
+    return NULL;
+}
+
+/* A miss to load, built by file_cache_pin_files() once it has claimed a slot for the file.
+ * The jobs of one pin batch are loaded together by load_batch().
+ */
+struct __load_job {
+    struct __cache_shard *shard; /* Shard owning the slot */
+    int slot;                    /* Claimed slot, 'loading' until load_finish() */
+    int fd;                      /* The file, opened when the slot was claimed */
+    int ret;                     /* slot_load() result */
+    int pin;                     /* Index of the slot's pin in the pinning batch, see pin_batch() */
+    struct iovec iov;            /* io_uring path: the slot's buffer */
+    struct __load_batch *batch;  /* Pool path: batch to report completion to */
+    struct __load_job *next;     /* Pool path: next job on ioHead */
+};
+
+/* Completion count of the jobs of a batch handed to the worker pool */
+struct __load_batch {
+    pthread_mutex_t lock;
+    pthread_cond_t donecv;       /* Signaled when pending drops to 0 */
+    int pending;                 /* Jobs not loaded yet */
+};
+
+/* @param: name: file to create.
+ * Notes:
+ * Creates a missing file of 10Kb of '\0'. It is *NOT* read into the cache. The blocks are
+ * allocated up front with fallocate(), or the file is just extended where the filesystem
+ * can't do that.
+ */
+static void file_create(const char *name)
+{
+    int fd, ret;
+
+    fd = open(name, O_WRONLY | O_CREAT, 0666);
+    if ( fd < 0 )
+	return;
+    ret = fallocate(fd, 0, 0, CACHE_SIZE);
+    if ( ret )
+	ret = ftruncate(fd, CACHE_SIZE);
+    dbug_p(" RET FROM FALLOCATE:%d\n", ret); // ABHI
+    (void) ret;
+    close(fd);
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   shard: shard owning the slot, locked by the caller.
+ *   slot: slot whose load failed.
+ * Notes:
+ * Drops one pin of a failed slot. The last one gives the slot back to the free list.
+ */
+static void slot_unclaim(file_cache *cache, struct __cache_shard *shard, int slot)
+{
+    struct __node_cache *node = &cache->nodeHead[slot];
+
+    __atomic_store_n(&node->refCount, node->refCount - 1, __ATOMIC_RELAXED);
+    if ( 0 == node->refCount ) {
+	__atomic_sub_fetch(&cache->currentSize, 1, __ATOMIC_RELAXED);
+	index_del(cache, shard, slot);
+	buf_free(cache, shard, node);
+	slot_close_fd(cache, node);
+	slot_reset(node);
+	free_push(cache, shard, slot);
+	shard->currentSize -= 1;
+	admit_grant(shard);
+	pthread_cond_broadcast(&shard->slotcv);
+    }
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   job: loaded job.
+ *   usec: time the batch took to load, counted as the latency of each of its misses.
+ * Notes:
+ * Publishes the result of a load and wakes the pinners waiting for it.
+ */
+static void load_finish(file_cache *cache, struct __load_job *job, unsigned long long usec)
+{
+    struct __node_cache *node = &cache->nodeHead[job->slot];
+
+    pthread_mutex_lock(&job->shard->lock);
+    if ( job->ret )
+	__atomic_store_n(&node->loadFailed, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&node->loading, 0, __ATOMIC_RELEASE);   /* the data is in for index_read() */
+    if ( job->ret ) {
+	slot_unclaim(cache, job->shard, job->slot);
+    }
+    else {
+	dbug_p("PINNING:%s:\n", node->name); //ABHI
+	job->shard->stats.bytesRead += node->size;
+	if ( !node->prefetched )         /* Still unreferenced read ahead is no miss */
+	    hist_add(job->shard->stats.missLatency, usec);
+    }
+    pthread_cond_broadcast(&job->shard->loadcv);
+    pthread_mutex_unlock(&job->shard->lock);
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   shard: shard owning the slot, locked by the caller.
+ *   slot: pinned, loaded slot.
+ * Notes:
+ * Drops one pin. When it was the last the slot stays resident, as most recently used: on the
+ * LRU list if clean, else on the dirty list for the flusher (unless the flusher has it already).
+ */
+static void slot_unpin(file_cache *cache, struct __cache_shard *shard, int slot)
+{
+    struct __node_cache *node = &cache->nodeHead[slot];
+
+    __atomic_store_n(&node->refCount, node->refCount - 1, __ATOMIC_RELAXED);
+    if ( node->refCount > 0 )
+	return;
+    dbug_p("UNPINNING:%s:\n", node->name); //ABHI
+    __atomic_sub_fetch(&cache->currentSize, 1, __ATOMIC_RELAXED);
+    if ( node->flushing )
+	;                                    /* flusher lists it once its write is done */
+    else if ( node->dirty ) {
+	if ( dirty_add(cache, shard, slot) >= cache->flushHighWater || shard->admitHead )
+	    flusher_kick(cache);      /* Pins queued for a slot wait on the flusher too */
+    }
+    else {
+	lru_add(cache, shard, slot);
+	admit_grant(shard);
+	pthread_cond_broadcast(&shard->slotcv); /* Wake the threads blocking for room, sizes differ */
+    }
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   shard: shard owning the slot, locked by the caller.
+ *   slot: slot a failed pin batch holds a pin on, whatever its state.
+ * Notes:
+ * Takes back a pin of a batch that gave up. A slot still 'loading' is read by another pin, which
+ * holds a pin of its own, so only the count drops.
+ */
+static void slot_drop(file_cache *cache, struct __cache_shard *shard, int slot)
+{
+    struct __node_cache *node = &cache->nodeHead[slot];
+
+    if ( node->loading )
+	__atomic_store_n(&node->refCount, node->refCount - 1, __ATOMIC_RELAXED);
+    else if ( node->loadFailed )
+	slot_unclaim(cache, shard, slot);
+    else
+	slot_unpin(cache, shard, slot);
+}
+
+#ifdef FC_HAVE_IO_URING
+/* A thread's io_uring, set up on its first batch and torn down when the thread exits.
+ * Only its own thread submits to it, so the rings need no locking. A ring holds no state of any
+ * cache between two batches, so one ring serves every cache the thread pins in.
+ */
+struct __io_ring {
+    int fd;
+    unsigned int entries;        /* Submission queue size */
+    unsigned int *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned int *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize, sqesSize;
+};
+
+static __thread struct __io_ring *threadRing;
+static pthread_key_t ringKey;
+static pthread_once_t ringOnce = PTHREAD_ONCE_INIT;
+static int ringBroken;           /* io_uring_setup() failed for good, don't try again */
+
+static void ring_free(void *arg)
+{
+    struct __io_ring *ring = (struct __io_ring *) arg;
+
+    if ( ring->sqes && MAP_FAILED != (void *) ring->sqes )
+	munmap(ring->sqes, ring->sqesSize);
+    if ( ring->cqRing && MAP_FAILED != ring->cqRing && ring->cqRing != ring->sqRing )
+	munmap(ring->cqRing, ring->cqRingSize);
+    if ( ring->sqRing && MAP_FAILED != ring->sqRing )
+	munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+    free(ring);
+}
+
+static void ring_key_init(void)
+{
+    pthread_key_create(&ringKey, ring_free);
+}
+
+/* @ret: the calling thread's io_uring, NULL if the kernel doesn't have one for us.
+ * Notes:
+ * Maps the submission and completion rings the way the io_uring_setup(2) man page describes.
+ */
+static struct __io_ring *ring_get(void)
+{
+    struct io_uring_params p;
+    struct __io_ring *ring;
+    unsigned char *sq, *cq;
+    int fd;
+
+    if ( threadRing || __atomic_load_n(&ringBroken, __ATOMIC_RELAXED) )
+	return threadRing;
+    pthread_once(&ringOnce, ring_key_init);
+
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, FC_RING_ENTRIES, &p);
+    if ( fd < 0 ) {
+	if ( ENOSYS == errno || EPERM == errno || EINVAL == errno )
+	    __atomic_store_n(&ringBroken, 1, __ATOMIC_RELAXED);
+	return NULL;
+    }
+    ring = calloc(1, sizeof(struct __io_ring));
+    if ( !ring ) {
+	close(fd);
+	return NULL;
+    }
+    ring->fd = fd;
+    ring->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+#ifdef IORING_FEAT_SINGLE_MMAP
+    if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+	if ( ring->cqRingSize > ring->sqRingSize )
+	    ring->sqRingSize = ring->cqRingSize;
+	ring->cqRingSize = ring->sqRingSize;
+    }
+#endif
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			fd, IORING_OFF_SQ_RING);
+    if ( MAP_FAILED == ring->sqRing ) {
+	ring_free(ring);
+	return NULL;
+    }
+#ifdef IORING_FEAT_SINGLE_MMAP
+    if ( p.features & IORING_FEAT_SINGLE_MMAP )
+	ring->cqRing = ring->sqRing;
+    else
+#endif
+	ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			    fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		      fd, IORING_OFF_SQES);
+    if ( MAP_FAILED == ring->cqRing || MAP_FAILED == (void *) ring->sqes ) {
+	ring_free(ring);
+	return NULL;
+    }
+
+    sq = ring->sqRing;
+    cq = ring->cqRing;
+    ring->entries = p.sq_entries;
+    ring->sqHead = (unsigned int *) (sq + p.sq_off.head);
+    ring->sqTail = (unsigned int *) (sq + p.sq_off.tail);
+    ring->sqMask = (unsigned int *) (sq + p.sq_off.ring_mask);
+    ring->sqArray = (unsigned int *) (sq + p.sq_off.array);
+    ring->cqHead = (unsigned int *) (cq + p.cq_off.head);
+    ring->cqTail = (unsigned int *) (cq + p.cq_off.tail);
+    ring->cqMask = (unsigned int *) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    pthread_setspecific(ringKey, ring);
+    threadRing = ring;
+    return ring;
+}
+
+/* @param: ring: the calling thread's ring.
+ *   jobs, n: copy mode jobs to read, with their iov set.
+ *   next: set to the first job that was not submitted.
+ * @ret: 0 once every read has completed, -1 if the ring failed. The jobs from *next on are then
+ *       left for the caller to read itself.
+ *
+ * Notes:
+ * Keeps up to ring->entries reads in flight and reaps completions in between, so the batch takes
+ * about as long as its slowest read. A short read is finished with pread(). Reads already in
+ * flight when the ring fails are always waited for, as they land in the slots' buffers.
+ */
+static int ring_read(struct __io_ring *ring, struct __load_job *jobs, int n, int *next)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct __load_job *job;
+    unsigned int tail, head, cqTail, idx;
+    int i = 0, inflight = 0, unsubmitted = 0, failed = 0, queued, ret;
+
+    while ( (!failed && i < n) || inflight ) {
+	if ( !failed ) {
+	    tail = *ring->sqTail;
+	    for ( queued = 0; i < n && inflight + unsubmitted + queued < (int) ring->entries; i++, queued++ ) {
+		job = &jobs[i];
+		job->ret = -1;
+		idx = tail & *ring->sqMask;
+		sqe = &ring->sqes[idx];
+		memset(sqe, 0, sizeof(struct io_uring_sqe));
+		sqe->opcode = IORING_OP_READV;
+		sqe->fd = job->fd;
+		sqe->addr = (unsigned long) &job->iov;
+		sqe->len = 1;
+		sqe->off = 0;
+		sqe->user_data = (unsigned long) (uintptr_t) job;
+		ring->sqArray[idx] = idx;
+		tail++;
+	    }
+	    __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+	    unsubmitted += queued;
+	}
+
+	ret = syscall(__NR_io_uring_enter, ring->fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+	if ( ret >= 0 ) {
+	    inflight += ret;
+	    unsubmitted -= ret;
+	}
+	else if ( EINTR != errno && EAGAIN != errno && EBUSY != errno ) {
+	    if ( !failed ) { /* Take back what the kernel hasn't consumed, the caller reads those */
+		__atomic_store_n(ring->sqTail, __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE),
+				 __ATOMIC_RELEASE);
+		i -= unsubmitted;
+		unsubmitted = 0;
+		failed = 1;
+	    }
+	    else             /* Can't even wait, poll for the reads in flight */
+		sched_yield();
+	}
+
+	head = *ring->cqHead;
+	cqTail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+	for ( ; head != cqTail; head++, inflight-- ) {
+	    cqe = &ring->cqes[head & *ring->cqMask];
+	    job = (struct __load_job *) (uintptr_t) cqe->user_data;
+	    if ( cqe->res >= 0 )
+		job->ret = fd_read(job->fd, job->iov.iov_base, cqe->res, job->iov.iov_len);
+	}
+	__atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+    *next = i;
+    return failed ? -1 : 0;
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   jobs, n: copy mode jobs of a batch.
+ * @ret: 0 if loaded, -1 if this thread has no usable io_uring.
+ * Notes:
+ * Reads every file of the batch through the ring at once, each into its slot's buffer.
+ */
+static int ring_load(file_cache *cache, struct __load_job *jobs, int n)
+{
+    struct __io_ring *ring = ring_get();
+    struct __node_cache *node;
+    int i, next;
+
+    if ( !ring )
+	return -1;
+    for ( i = 0; i < n; i++ ) {
+	node = &cache->nodeHead[jobs[i].slot];
+	jobs[i].iov.iov_base = node->cache;
+	jobs[i].iov.iov_len = node->size;
+    }
+
+    if ( ring_read(ring, jobs, n, &next) ) {
+	dbug_p("io_uring failed, reading the rest of the batch directly\n");
+	pthread_setspecific(ringKey, NULL);
+	threadRing = NULL;
+	ring_free(ring);
+	for ( i = next; i < n; i++ )
+	    jobs[i].ret = fd_read(jobs[i].fd, jobs[i].iov.iov_base, 0, jobs[i].iov.iov_len);
+    }
+    for ( i = 0; i < n; i++ ) {
+	if ( jobs[i].ret )
+	    close(jobs[i].fd);
+	else
+	    slot_keep_fd(cache, &cache->nodeHead[jobs[i].slot], jobs[i].fd);
+    }
+    return 0;
+}
+#endif /* FC_HAVE_IO_URING */
+
+/* A file queued by file_cache_prefetch_files(), or by the constructor from the manifest */
+struct __prefetch {
+    struct __prefetch *next;     /* Next queued prefetch, -> pfHead */
+    int warm;                    /* From the manifest, listed again if still queued when it is saved */
+    char name[];                 /* Name of the file */
+};
+
+static int pin_batch(file_cache *cache, const char **files, int num_files,
+		     const struct timespec *deadline, char *pinned, file_cache_handle *handles, int prefetch);
+
+/* @param: cache: pointer to file_cache structure.
+ *   name: file to read ahead.
+ * Notes:
+ * A try pin and an unpin. The slot it reads in is marked 'prefetched', so that the first real pin
+ * of the file counts as its first reference and doesn't make it hot. A file that doesn't exist is
+ * skipped, not created, see batch_scan().
+ */
+static void prefetch_one(file_cache *cache, const char *name)
+{
+    struct timespec past = { 0, 0 };
+
+    if ( pin_batch(cache, &name, 1, &past, NULL, NULL, 1) > 0 )
+	file_cache_unpin_files(cache, &name, 1);
+}
+
+/* @param: arg: the file_cache whose load jobs to run.
+ * Notes:
+ * Body of the io workers. Runs queued load jobs until destroy sets ioStop. When none is queued
+ * the worker reads in the next prefetched file, with a try pin and an unpin, so that a prefetch
+ * never waits for room and never holds up the pins behind it for longer than one file.
+ */
+static void *io_worker_main(void *arg)
+{
+    file_cache *cache = (file_cache *) arg;
+    struct __load_batch *batch;
+    struct __load_job *job;
+    struct __prefetch *pf;
+
+    pthread_mutex_lock(&cache->ioLock);
+    for ( ;; ) {
+	while ( !cache->ioHead && !cache->pfHead && !cache->ioStop )
+	    pthread_cond_wait(&cache->iocv, &cache->ioLock);
+	if ( cache->ioStop )
+	    break;
+	if ( !cache->ioHead ) {              /* Nothing a pin waits for, read ahead */
+	    pf = cache->pfHead;
+	    cache->pfHead = pf->next;
+	    if ( !cache->pfHead )
+		cache->pfTail = NULL;
+	    cache->pfPending -= 1;
+	    pthread_mutex_unlock(&cache->ioLock);
+
+	    prefetch_one(cache, pf->name);
+	    free(pf);
+
+	    pthread_mutex_lock(&cache->ioLock);
+	    continue;
+	}
+	job = cache->ioHead;
+	cache->ioHead = job->next;
+	if ( !cache->ioHead )
+	    cache->ioTail = NULL;
+	pthread_mutex_unlock(&cache->ioLock);
+
+	job->ret = slot_load(cache, &cache->nodeHead[job->slot], job->fd);
+	batch = job->batch;                  /* job and batch are gone once pending hits 0 */
+	pthread_mutex_lock(&batch->lock);
+	if ( 0 == --batch->pending )
+	    pthread_cond_signal(&batch->donecv);
+	pthread_mutex_unlock(&batch->lock);
+
+	pthread_mutex_lock(&cache->ioLock);
+    }
+    pthread_mutex_unlock(&cache->ioLock);
+    return NULL;
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   jobs, n: jobs of a batch.
+ * Notes:
+ * Queues the jobs to the io workers and waits until all of them are loaded.
+ */
+static void pool_load(file_cache *cache, struct __load_job *jobs, int n)
+{
+    struct __load_batch batch;
+    int i;
+
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.donecv, NULL);
+    batch.pending = n;
+
+    pthread_mutex_lock(&cache->ioLock);
+    for ( i = 0; i < n; i++ ) {
+	jobs[i].batch = &batch;
+	jobs[i].next = NULL;
+	if ( cache->ioTail )
+	    cache->ioTail->next = &jobs[i];
+	else
+	    cache->ioHead = &jobs[i];
+	cache->ioTail = &jobs[i];
+    }
+    pthread_cond_broadcast(&cache->iocv);
+    pthread_mutex_unlock(&cache->ioLock);
+
+    pthread_mutex_lock(&batch.lock);
+    while ( batch.pending )
+	pthread_cond_wait(&batch.donecv, &batch.lock);
+    pthread_mutex_unlock(&batch.lock);
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.donecv);
+}
+
+/* @param: cache: pointer to file_cache structure, FILE_CACHE_MODE_COPY.
+ *   job: claimed miss, not read yet.
+ * @ret: 1 if the file has no data on disk and the slot is loaded as zeros, 0 if it has to be read.
+ *
+ * Notes:
+ * A file the cache created for a missing one, or any other file that is all holes, reports no
+ * data to SEEK_DATA, and reading it would only copy zeros.
+ */
+static int slot_load_hole(file_cache *cache, struct __load_job *job)
+{
+    struct __node_cache *node = &cache->nodeHead[job->slot];
+
+    if ( lseek(job->fd, 0, SEEK_DATA) >= 0 || ENXIO != errno )
+	return 0;
+    slot_keep_fd(cache, node, job->fd);
+    slot_zero(node);
+    job->ret = 0;
+    return 1;
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   jobs, n: slots claimed by a pin batch, all 'loading'.
+ * Notes:
+ * Loads the misses of a batch concurrently and returns when every one has landed, so the batch
+ * costs about its slowest read rather than the sum of its reads. Copy mode reads go through the
+ * calling thread's io_uring where the kernel has it, and otherwise (or in FILE_CACHE_MODE_MMAP,
+ * where a load is an mmap() and not a read) the jobs are handed to the io workers. A lone miss,
+ * or a cache without workers, is loaded right here. No shard lock is held meanwhile.
+ */
+static void load_batch(file_cache *cache, struct __load_job *jobs, int n)
+{
+    struct __load_job tmp;
+    struct __node_cache *node;
+    struct timespec start;
+    unsigned long long usec;
+    int i, m = n, done = 0;
+
+    if ( 0 == n )
+	return;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ( cache->zeroBuf && FILE_CACHE_MODE_COPY == cache->mode ) {
+	for ( i = 0; i < m; ) {             /* holes go to the end, past what gets read */
+	    if ( !slot_load_hole(cache, &jobs[i]) ) {
+		i++;
+		continue;
+	    }
+	    tmp = jobs[i];
+	    jobs[i] = jobs[--m];
+	    jobs[m] = tmp;
+	}
+    }
+    if ( m > 1 ) {
+#ifdef FC_HAVE_IO_URING
+	if ( FILE_CACHE_MODE_COPY == cache->mode && cache->ioUring )
+	    done = !ring_load(cache, jobs, m);
+#endif
+	if ( !done && cache->numIoThreads > 0 ) {
+	    pool_load(cache, jobs, m);
+	    done = 1;
+	}
+    }
+    if ( !done ) {
+	for ( i = 0; i < m; i++ )
+	    jobs[i].ret = slot_load(cache, &cache->nodeHead[jobs[i].slot], jobs[i].fd);
+    }
+    for ( i = 0; i < n && FILE_CACHE_MODE_COPY == cache->mode; i++ ) {
+	node = &cache->nodeHead[jobs[i].slot];
+	if ( jobs[i].ret )
+	    continue;
+	if ( i < m && cache->zeroBuf && buf_is_zero(node->cache, node->size) )
+	    slot_zero(node);
+	node->crc = crc32c(node->zero ? cache->zeroBuf : node->cache, node->size);
+	node->crcValid = 1;
+    }
+    usec = usec_since(&start);
+    for ( i = 0; i < n; i++ )
+	load_finish(cache, &jobs[i], usec);
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   num: workers started, numIoThreads is set to it.
+ * Notes:
+ * Stops and joins the io workers, letting the prefetches in flight finish. Called by destroy once
+ * no pin can be in flight.
+ */
+static void io_pool_stop(file_cache *cache, int num)
+{
+    int i;
+
+    struct __prefetch *pf;
+
+    pthread_mutex_lock(&cache->ioLock);
+    cache->ioStop = 1;
+    pthread_cond_broadcast(&cache->iocv);
+    pthread_mutex_unlock(&cache->ioLock);
+    for ( i = 0; i < num; i++ )
+	pthread_join(cache->ioThreads[i], NULL);
+    while ( (pf = cache->pfHead) ) {    /* Prefetches not started are dropped */
+	cache->pfHead = pf->next;
+	free(pf);
+    }
+    cache->pfTail = NULL;
+    free(cache->ioThreads);
+    cache->ioThreads = NULL;
+    pthread_mutex_destroy(&cache->ioLock);
+    pthread_cond_destroy(&cache->iocv);
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   files, num_files: files to read ahead, in the order to read them.
+ *   warm: 1 for the files of the manifest, see struct __prefetch.
+ * Notes:
+ * Queues the files for the io workers and wakes them, see io_worker_main(). A file is dropped if
+ * maxSize prefetches are queued already, more than the cache could hold anyway. Without workers
+ * each file is read in right here, with the same try pin and unpin.
+ */
+static void prefetch_queue(file_cache *cache, const char **files, int num_files, int warm)
+{
+    struct __prefetch *pf, *head = NULL, *tail = NULL;
+    size_t len;
+    int i, n = 0;
+
+    if ( 0 == cache->numIoThreads ) {
+	for ( i = 0; i < num_files; i++ )
+	    prefetch_one(cache, files[i]);
+	return;
+    }
+
+    /* Copy the names outside of ioLock, then queue them all at once */
+    for ( i = 0; i < num_files && i < cache->maxSize; i++ ) {
+	len = strlen(files[i]) + 1;
+	pf = malloc(sizeof(struct __prefetch) + len);
+	if ( !pf )
+	    break;
+	memcpy(pf->name, files[i], len);
+	pf->warm = warm;
+	pf->next = NULL;
+	if ( tail )
+	    tail->next = pf;
+	else
+	    head = pf;
+	tail = pf;
+	n++;
+    }
+
+    pthread_mutex_lock(&cache->ioLock);
+    while ( head && cache->pfPending + n > cache->maxSize ) {   /* Queue full, drop the excess */
+	pf = head;
+	head = pf->next;
+	free(pf);
+	n--;
+    }
+    if ( head ) {
+	if ( cache->pfTail )
+	    cache->pfTail->next = head;
+	else
+	    cache->pfHead = head;
+	cache->pfTail = tail;
+	cache->pfPending += n;
+	pthread_cond_broadcast(&cache->iocv);
+    }
+    pthread_mutex_unlock(&cache->ioLock);
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   shard: shard to list, locked by the caller.
+ *   names: array to append copies of the names to, most recently used first.
+ *   n: entries in names so far, moved on.
+ *   max: room in names.
+ * Notes:
+ * The pinned slots come first, then the protected list, the dirty list and the LRU list, each
+ * from its newest end. The names are copied, the slots may be gone once the lock is dropped.
+ */
+static void manifest_shard(file_cache *cache, struct __cache_shard *shard, char **names, int *n, int max)
+{
+    int heads[3] = { shard->protTail, shard->dirtyTail, shard->lruTail };
+    struct __node_cache *node;
+    int i, slot;
+
+    for ( slot = shard->firstSlot; slot < shard->firstSlot + shard->maxSize && *n < max; slot++ ) {
+	node = &cache->nodeHead[slot];
+	if ( node->refCount > 0 && !node->loading && !node->loadFailed && !strchr(node->name, '\n') )
+	    names[(*n)++] = strdup(node->name);
+    }
+    for ( i = 0; i < 3; i++ ) {
+	for ( slot = heads[i]; slot >= 0 && *n < max; slot = cache->nodeHead[slot].lruPrev ) {
+	    if ( !strchr(cache->nodeHead[slot].name, '\n') )
+		names[(*n)++] = strdup(cache->nodeHead[slot].name);
+	}
+    }
+}
+
+/* @param: cache: pointer to file_cache structure.
+ * Notes:
+ * Queues the files listed in the manifest at cache->manifestPath to be read back in, the most
+ * recently used first. They load like prefetches, in between the misses of the pins, and a file
+ * deleted since the manifest was written is not created again. A manifest that is missing or
+ * doesn't start with FC_MANIFEST_MAGIC is ignored, a cache starts cold without one.
+ */
+static void manifest_load(file_cache *cache)
+{
+    char **names, *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int n = 0;
+    FILE *fp;
+
+    fp = fopen(cache->manifestPath, "r");
+    if ( !fp )
+	return;
+    names = malloc(cache->maxSize * sizeof(char *));
+    len = getline(&line, &cap, fp);
+    if ( names && len > 0 && 0 == strcmp(line, FC_MANIFEST_MAGIC "\n") ) {
+	while ( n < cache->maxSize && (len = getline(&line, &cap, fp)) > 1 && '\n' == line[len - 1] ) {
+	    line[len - 1] = '\0';
+	    names[n] = strdup(line);
+	    if ( !names[n] )
+		break;
+	    n++;
+	}
+	prefetch_queue(cache, (const char **) names, n, 1);
+    }
+    while ( n > 0 )
+	free(names[--n]);
+    free(names);
+    free(line);
+    fclose(fp);
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   shard: shard to set up.
+ *   firstSlot, maxSize: run of slots in nodeHead owned by the shard.
+ *   arena: the shard's run of the arena, NULL in FILE_CACHE_MODE_MMAP.
+ *   maxBytes: bytes of file data the shard may hold, the size of the run.
+ * @ret: 0 on success, -1 if the index can't be allocated.
+ * Notes:
+ * All the slots start on the free list, lowest slot first.
+ */
+static int shard_init(file_cache *cache, struct __cache_shard *shard, int firstSlot, int maxSize,
+		      char *arena, size_t maxBytes)
+{
+    pthread_condattr_t attr;
+    unsigned int buckets;
+    int slot, order;
+
+    /* Keep the index at most half full so chains stay short */
+    for ( buckets = 1; buckets < 2 * (unsigned int) maxSize; buckets <<= 1 )
+	;
+    shard->hashHead = malloc(buckets * sizeof(int));
+    if ( !shard->hashHead )
+	return -1;
+    memset(shard->hashHead, 0xff, buckets * sizeof(int)); /* all buckets -1 */
+    shard->hashMask = buckets - 1;
+    shard->seq = 0;
+    shard->retiredNames = NULL;
+    shard->firstSlot = firstSlot;
+    shard->maxSize = maxSize;
+    shard->currentSize = 0;
+    shard->lruHead = shard->lruTail = -1;
+    shard->lruSize = 0;
+    shard->protHead = shard->protTail = -1;
+    shard->protSize = 0;
+    shard->protMax = (long) maxSize * FC_SLRU_PROTECTED_PCT / 100;
+    shard->reserved = 0;
+    shard->admitHead = shard->admitTail = NULL;
+    shard->dirtyHead = shard->dirtyTail = -1;
+    shard->dirtySize = 0;
+    memset(&shard->stats, 0, sizeof(shard->stats));
+    shard->freeHead = -1;
+    for ( slot = firstSlot + maxSize - 1; slot >= firstSlot; slot-- )
+	free_push(cache, shard, slot);
+
+    /* The whole run of the arena starts out free */
+    shard->maxBytes = maxBytes;
+    shard->usedBytes = 0;
+    shard->arena = arena;
+    shard->arenaUnits = 0;
+    shard->maxOrder = 0;
+    shard->blockOrder = NULL;
+    for ( order = 0; order < FC_ORDERS; order++ )
+	shard->freeBlock[order] = -1;
+    if ( arena ) {
+	shard->arenaUnits = maxBytes >> FC_BLOCK_SHIFT;
+	while ( shard->maxOrder < FC_ORDERS - 1 && (2 << shard->maxOrder) <= shard->arenaUnits )
+	    shard->maxOrder++;
+	shard->blockOrder = calloc(shard->arenaUnits, 1);
+	if ( !shard->blockOrder ) {
+	    free(shard->hashHead);
+	    return -1;
+	}
+	range_free(shard, 0, shard->arenaUnits);
+    }
+    pthread_mutex_init(&shard->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);   /* Timed pins wait against the monotonic clock */
+    pthread_cond_init(&shard->slotcv, &attr);
+    pthread_cond_init(&shard->loadcv, &attr);
+    pthread_condattr_destroy(&attr);
+    return 0;
+}
+
+/* @param: shards: array of shards.
+ *   num: number of shards in the array that were set up by shard_init().
+ */
+static void shards_free(struct __cache_shard *shards, int num)
+{
+    struct __name_buf *buf;
+    int i;
+
+    for ( i = 0; i < num; i++ ) {
+	pthread_mutex_destroy(&shards[i].lock);
+	pthread_cond_destroy(&shards[i].slotcv);
+	pthread_cond_destroy(&shards[i].loadcv);
+	free(shards[i].hashHead);
+	free(shards[i].blockOrder);
+	while ( shards[i].retiredNames ) {
+	    buf = shards[i].retiredNames;
+	    shards[i].retiredNames = buf->next;
+	    free(buf);
+	}
+    }
+    free(shards);
+}
+
+/* @param: size: bytes needed.
+ *   hugePages: 1 to try huge pages first.
+ *   mapped: set to the bytes actually mapped.
+ * @ret: page aligned anonymous memory, NULL if it can't be mapped.
+ *
+ * Notes:
+ * With hugePages the arena is first mapped with MAP_HUGETLB, which needs huge pages reserved in
+ * /proc/sys/vm/nr_hugepages. Failing that it falls back to normal pages and asks for transparent
+ * huge pages instead.
+ */
+static char *arena_alloc(size_t size, int hugePages, size_t *mapped)
+{
+    size_t page = sysconf(_SC_PAGESIZE), len;
+    void *mem;
+
+#ifdef MAP_HUGETLB
+    if ( hugePages ) {
+	len = (size + FC_HUGE_PAGE_SIZE - 1) & ~(FC_HUGE_PAGE_SIZE - 1);
+	mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if ( MAP_FAILED != mem ) {
+	    *mapped = len;
+	    return mem;
+	}
+	dbug_p("No reserved huge pages, falling back to normal pages\n");
+    }
+#endif
+    len = (size + page - 1) & ~(page - 1);
+    mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( MAP_FAILED == mem )
+	return NULL;
+#ifdef MADV_HUGEPAGE
+    if ( hugePages )
+	madvise(mem, len, MADV_HUGEPAGE);
+#endif
+    *mapped = len;
+    return mem;
+}
+
+/* @param: conf: conf to fill.
+ *   max_cache_entries: Maximum entries in the file cache.
+ * Notes:
+ * numShards is left 0 so that the constructor derives it from maxEntries. The flusher wakes up
+ * early once a quarter of the cache is dirty and waiting for it. Misses of a pin batch are
+ * read through io_uring where the kernel has it, with FC_IO_THREADS workers as the fallback.
+ * Every cached file keeps its descriptor open, up to half of RLIMIT_NOFILE.
+ */
+void file_cache_conf_init(struct file_cache_conf *conf, int max_cache_entries)
+{
+    struct rlimit rl;
+
+    memset(conf, 0, sizeof(struct file_cache_conf));
+    conf->maxEntries = max_cache_entries;
+    conf->numShards = 0;
+    conf->flushIntervalMs = FC_FLUSH_INTERVAL_MS;
+    conf->flushHighWater = max_cache_entries / 4;
+    conf->groupCommitUs = FC_GROUP_COMMIT_US;
+    conf->ioThreads = FC_IO_THREADS;
+    conf->ioUring = 1;
+
+    /* Keep a descriptor per entry, but leave half of the process' descriptors to the client */
+    conf->maxOpenFds = max_cache_entries;
+    if ( !getrlimit(RLIMIT_NOFILE, &rl) && RLIM_INFINITY != rl.rlim_cur
+	 && (rlim_t) conf->maxOpenFds > rl.rlim_cur / 2 )
+	conf->maxOpenFds = rl.rlim_cur / 2;
+}
+
+/* @param: int max_cache_entries: Maximum entries in the file cache.
+ * @ret: file_cache* poniter to file_cache structure. 
+ * Notes:
+ * This the constructor for the user level file cache, with the default tunables.
+ * See file_cache_construct_with().
+ */
+file_cache *file_cache_construct(int max_cache_entries)
+{
+    struct file_cache_conf conf;
+
+    file_cache_conf_init(&conf, max_cache_entries);
+    return file_cache_construct_with(&conf);
+}
+
+/* @param: conf: tunables for the cache, see struct file_cache_conf.
+ * @ret: file_cache* poniter to file_cache structure. 
+ * Notes:
+ * This the constructor for the user level file cache. 
+ * It initializes the file_cache structure which contains the metadata for the file cache.
+ * Every call returns a new, independent instance with its own slots, arena, shard locks, flusher
+ * and io workers, so a process can keep as many caches as it likes, each with its own limits.
+ * Client are expected to use the function pointers perform operation on the file cache.
+ *
+ * The number of shards is rounded down to a power of 2 and capped so that every shard gets
+ * at least one slot. If not given it is the largest power of 2 that leaves every shard
+ * FC_MIN_SHARD_ENTRIES slots and FC_MIN_SHARD_BYTES of the arena. Without maxBytes the cache
+ * has FC_ENTRY_BYTES per entry, which holds maxEntries files of 10Kb.
+ */
+file_cache *file_cache_construct_with(const struct file_cache_conf *conf)
+{
+    file_cache *fileCachePt;
+    pthread_condattr_t attr;
+    int max_cache_entries, numShards, i, first, per, extra;
+    size_t maxBytes, shardBytes, page = sysconf(_SC_PAGESIZE);
+
+    if ( !conf || conf->maxEntries <= 0 )
+	return NULL;
+    max_cache_entries = conf->maxEntries;
+    maxBytes = conf->maxBytes > 0 ? conf->maxBytes : (size_t) max_cache_entries * FC_ENTRY_BYTES;
+
+    numShards = conf->numShards;
+    if ( numShards <= 0 ) {
+	numShards = max_cache_entries / FC_MIN_SHARD_ENTRIES;
+	if ( (size_t) numShards > maxBytes / FC_MIN_SHARD_BYTES )
+	    numShards = maxBytes / FC_MIN_SHARD_BYTES;
+    }
+    if ( (size_t) numShards > maxBytes / FC_MIN_BLOCK )
+	numShards = maxBytes / FC_MIN_BLOCK;
+    if ( numShards > FC_MAX_SHARDS )
+	numShards = FC_MAX_SHARDS;
+    if ( numShards > max_cache_entries )
+	numShards = max_cache_entries;
+    for ( i = 1; 2 * i <= numShards; i <<= 1 )  /* round down to a power of 2 */
+	;
+    numShards = i;
+
+    /* Every shard gets the same bytes, page aligned if it has a page */
+    shardBytes = maxBytes / numShards;
+    shardBytes &= shardBytes >= page ? ~(page - 1) : ~(size_t) (FC_MIN_BLOCK - 1);
+    if ( !shardBytes )
+	return NULL;
+
+    fileCachePt = malloc(sizeof(struct file_cache));
+    if ( !fileCachePt )
+	return NULL;
+
+    memset(fileCachePt, 0, sizeof(struct file_cache));
+    fileCachePt->logFd = -1;
+    fileCachePt->maxSize = max_cache_entries;
+    fileCachePt->maxBytes = shardBytes * numShards;
+    fileCachePt->currentSize = 0;
+
+    fileCachePt->nodeHead = malloc(max_cache_entries *(sizeof(struct __node_cache)));
+    if ( !fileCachePt->nodeHead ) {
+	free(fileCachePt);
+	return NULL;
+    }
+
+    memset(fileCachePt->nodeHead,  0, max_cache_entries *(sizeof(struct __node_cache)));
+
+    /* Map the memory for the buffers of all slots up front, unless slots map their files */
+    fileCachePt->mode = FILE_CACHE_MODE_MMAP == conf->mode ? FILE_CACHE_MODE_MMAP : FILE_CACHE_MODE_COPY;
+    fileCachePt->policy = FILE_CACHE_POLICY_SLRU == conf->policy ? FILE_CACHE_POLICY_SLRU : FILE_CACHE_POLICY_LRU;
+    fileCachePt->padTo10Kb = conf->padTo10Kb ? 1 : 0;
+    if ( FILE_CACHE_MODE_COPY == fileCachePt->mode ) {
+	fileCachePt->arena = arena_alloc(fileCachePt->maxBytes, conf->hugePages, &fileCachePt->arenaSize);
+	if ( !fileCachePt->arena ) {
+	    free(fileCachePt->nodeHead);
+	    free(fileCachePt);
+	    return NULL;
+	}
+    }
+    /* Never written, so every page of it is the kernel's zero page. Zero files go without if it
+       fails. In FILE_CACHE_MODE_MMAP it only stands in for the mapping of empty files */
+    fileCachePt->zeroSize = FILE_CACHE_MODE_COPY == fileCachePt->mode ? (shardBytes + 4095) & ~(size_t) 4095 : 4096;
+    fileCachePt->zeroBuf = mmap(NULL, fileCachePt->zeroSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( MAP_FAILED == fileCachePt->zeroBuf )
+	fileCachePt->zeroBuf = NULL;
+    for ( i = 0; i < max_cache_entries; i++ )
+	slot_reset(&fileCachePt->nodeHead[i]);
+
+    /* Split the slots evenly, the first 'extra' shards get one more, and the arena in equal runs */
+    if ( posix_memalign((void **) &fileCachePt->shards, 64, numShards * sizeof(struct __cache_shard)) ) {
+	if ( fileCachePt->arena )
+	    munmap(fileCachePt->arena, fileCachePt->arenaSize);
+	if ( fileCachePt->zeroBuf )
+	    munmap((void *) fileCachePt->zeroBuf, fileCachePt->zeroSize);
+	free(fileCachePt->nodeHead);
+	free(fileCachePt);
+	return NULL;
+    }
+    per = max_cache_entries / numShards;
+    extra = max_cache_entries % numShards;
+    for ( i = 0, first = 0; i < numShards; i++ ) {
+	if ( shard_init(fileCachePt, &fileCachePt->shards[i], first, per + (i < extra),
+			fileCachePt->arena ? fileCachePt->arena + i * shardBytes : NULL, shardBytes) ) {
+	    shards_free(fileCachePt->shards, i);
+	    if ( fileCachePt->arena )
+		munmap(fileCachePt->arena, fileCachePt->arenaSize);
+	    if ( fileCachePt->zeroBuf )
+		munmap((void *) fileCachePt->zeroBuf, fileCachePt->zeroSize);
+	    free(fileCachePt->nodeHead);
+	    free(fileCachePt);
+	    return NULL;
+	}
+	first += per + (i < extra);
+    }
+    fileCachePt->numShards = numShards;
+
+    /* Start the io workers loading the misses of pin batches */
+    fileCachePt->ioUring = conf->ioUring ? 1 : 0;
+    fileCachePt->maxOpenFds = conf->maxOpenFds > 0 ? conf->maxOpenFds : 0;
+    pthread_mutex_init(&fileCachePt->ioLock, NULL);
+    pthread_cond_init(&fileCachePt->iocv, NULL);
+    if ( conf->ioThreads > 0 ) {
+	fileCachePt->ioThreads = malloc(conf->ioThreads * sizeof(pthread_t));
+	for ( i = 0; fileCachePt->ioThreads && i < conf->ioThreads; i++ ) {
+	    if ( pthread_create(&fileCachePt->ioThreads[i], NULL, io_worker_main, fileCachePt) )
+		break;
+	}
+	if ( i < conf->ioThreads ) {
+	    io_pool_stop(fileCachePt, fileCachePt->ioThreads ? i : 0);
+	    shards_free(fileCachePt->shards, numShards);
+	    if ( fileCachePt->arena )
+		munmap(fileCachePt->arena, fileCachePt->arenaSize);
+	    if ( fileCachePt->zeroBuf )
+		munmap((void *) fileCachePt->zeroBuf, fileCachePt->zeroSize);
+	    free(fileCachePt->nodeHead);
+	    free(fileCachePt);
+	    return NULL;
+	}
+	fileCachePt->numIoThreads = conf->ioThreads;
+    }
+
+    /* Open the write log and replay what a previous run left in it, before any file is read in */
+    if ( conf->logPath && FILE_CACHE_MODE_COPY == fileCachePt->mode ) {
+	fileCachePt->logMax = conf->logMaxBytes > 0 ? conf->logMaxBytes : FC_LOG_MAX_BYTES;
+	fileCachePt->logFd = open(conf->logPath, O_RDWR | O_CREAT, 0666);
+	if ( fileCachePt->logFd < 0 || log_checkpoint(fileCachePt, 1) ) {
+	    if ( fileCachePt->logFd >= 0 )
+		close(fileCachePt->logFd);
+	    io_pool_stop(fileCachePt, fileCachePt->numIoThreads);
+	    shards_free(fileCachePt->shards, numShards);
+	    if ( fileCachePt->arena )
+		munmap(fileCachePt->arena, fileCachePt->arenaSize);
+	    if ( fileCachePt->zeroBuf )
+		munmap((void *) fileCachePt->zeroBuf, fileCachePt->zeroSize);
+	    free(fileCachePt->nodeHead);
+	    free(fileCachePt);
+	    return NULL;
+	}
+    }
+
+    /* Start the background flusher */
+    fileCachePt->flushIntervalMs = conf->flushIntervalMs > 0 ? conf->flushIntervalMs : 0;
+    fileCachePt->flushHighWater = conf->flushHighWater > 0 ? conf->flushHighWater : 1;
+    fileCachePt->durable = !!conf->durable;
+    fileCachePt->groupCommitUs = conf->groupCommitUs > 0 ? conf->groupCommitUs : 0;
+    pthread_mutex_init(&fileCachePt->flushLock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&fileCachePt->flushcv, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&fileCachePt->synccv, NULL);
+    if ( pthread_create(&fileCachePt->flusher, NULL, flusher_main, fileCachePt) ) {
+	pthread_mutex_destroy(&fileCachePt->flushLock);
+	pthread_cond_destroy(&fileCachePt->flushcv);
+	pthread_cond_destroy(&fileCachePt->synccv);
+	if ( fileCachePt->logFd >= 0 )
+	    close(fileCachePt->logFd);
+	io_pool_stop(fileCachePt, fileCachePt->numIoThreads);
+	shards_free(fileCachePt->shards, numShards);
+	if ( fileCachePt->arena )
+	    munmap(fileCachePt->arena, fileCachePt->arenaSize);
+	if ( fileCachePt->zeroBuf )
+	    munmap((void *) fileCachePt->zeroBuf, fileCachePt->zeroSize);
+	free(fileCachePt->nodeHead);
+	free(fileCachePt);
+	return NULL;
+    }
+
+    fileCachePt->file_cache_destroy = file_cache_destroy; 
+    fileCachePt->file_cache_file_size = file_cache_file_size;
+    fileCachePt->file_cache_pin_files = file_cache_pin_files;
+    fileCachePt->file_cache_try_pin_files = file_cache_try_pin_files;
+    fileCachePt->file_cache_timed_pin_files = file_cache_timed_pin_files;
+    fileCachePt->file_cache_unpin_files = file_cache_unpin_files;
+    fileCachePt->file_cache_file_data = file_cache_file_data;
+    fileCachePt->file_cache_mutable_file_data = file_cache_mutable_file_data;
+    fileCachePt->file_cache_mutable_file_range = file_cache_mutable_file_range;
+    fileCachePt->file_cache_prefetch_files = file_cache_prefetch_files;
+    fileCachePt->file_cache_get_stats = file_cache_get_stats;
+    fileCachePt->file_cache_sync = file_cache_sync;
+    fileCachePt->file_cache_pin_handles = file_cache_pin_handles;
+    fileCachePt->file_cache_unpin_handles = file_cache_unpin_handles;
+    fileCachePt->file_cache_handle_data = file_cache_handle_data;
+    fileCachePt->file_cache_handle_size = file_cache_handle_size;
+    fileCachePt->file_cache_mutable_handle_range = file_cache_mutable_handle_range;
+    fileCachePt->file_cache_save_manifest = file_cache_save_manifest;
+
+    /* Warm restart: read back what the last cache had resident, in the background. Without io
+       workers that would be a synchronous read of the whole manifest in here, so the cache
+       starts cold and only writes the manifest */
+    if ( conf->manifestPath ) {
+	fileCachePt->manifestPath = strdup(conf->manifestPath);
+	if ( fileCachePt->manifestPath && fileCachePt->numIoThreads > 0 )
+	    manifest_load(fileCachePt);
+    }
+    return fileCachePt;
+}
+/* @param: file_cache* cache: pointer to file cache structure.
+ * @ret: void
+ * Notes: 
+ *   This is the destructor for the file_cache. It only touches this instance, other caches
+ * of the process go on undisturbed. It first stops the flusher which writes
+ * back every dirty slot on its way out, pinned or not, and the io workers. Finally it frees all allocated
+ * memory starting from the bottom i.e. the names, the arena of 10Kb cache pages (or the
+ * mapped files in FILE_CACHE_MODE_MMAP),
+ * then the array of structure (struct __node_cache) and finally 
+ * file_cache structure itself.
+ * Also desstroys the mutex and condition variables of every shard.
+ *
+ */
+
+void file_cache_destroy(file_cache *cache)
+{
+    int size, i;
+
+    if ( !cache )
+	return;
+
+    /* List what is resident for the next cache, before the workers drop the queued prefetches */
+    if ( cache->manifestPath ) {
+	file_cache_save_manifest(cache);
+	free(cache->manifestPath);
+    }
+
+    /* Stop the io workers first, a prefetch in flight pins and unpins like any client */
+    io_pool_stop(cache, cache->numIoThreads);
+
+    /* Last flusher pass writes back all dirty slots */
+    pthread_mutex_lock(&cache->flushLock);
+    cache->flushStop = 1;
+    pthread_cond_signal(&cache->flushcv);
+    pthread_mutex_unlock(&cache->flushLock);
+    pthread_join(cache->flusher, NULL);
+    pthread_mutex_destroy(&cache->flushLock);
+    pthread_cond_destroy(&cache->flushcv);
+    pthread_cond_destroy(&cache->synccv);
+    if ( cache->logFd >= 0 )
+	close(cache->logFd);
+
+    size = cache->maxSize;
+    i = 0;
+
+    while ( i < size ) {  /* Free the name in each nodeCache, close its fd, and unmap its file in mmap mode */
+	if ( !cache->arena && cache->nodeHead[i].cache )
+	    munmap(cache->nodeHead[i].cache, cache->nodeHead[i].size ? cache->nodeHead[i].size : 1);
+	slot_close_fd(cache, &cache->nodeHead[i]);
+	if ( cache->nodeHead[i].name )
+	    free(NAME_BUF(cache->nodeHead[i].name));
+	i++;
+    }
+    if ( cache->arena )
+	munmap(cache->arena, cache->arenaSize);
+    if ( cache->zeroBuf )
+	munmap((void *) cache->zeroBuf, cache->zeroSize);
+
+    /* Now free nodeCache and the shards with their name index */
+    free(cache->nodeHead);
+    shards_free(cache->shards, cache->numShards);
+
+    /* Just to make sure that all dangling refrences will seg fault after this */
+    memset(cache, 0, sizeof(struct file_cache));
+
+    /* Now free file_cache structure */
+    free(cache);
+}
+
+/* One pin taken by pin_batch(), kept so that a failed batch can drop it again */
+struct __pin {
+    struct __cache_shard *shard; /* Shard owning the slot */
+    int slot;                    /* Pinned slot, -1 once the pin is gone (its load failed) */
+    int file;                    /* Index of the file in the batch */
+};
+
+/* @param: deadline: absolute CLOCK_MONOTONIC time.
+ * @ret: 1 if it has passed, else 0.
+ */
+static int deadline_passed(const struct timespec *deadline)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > deadline->tv_sec
+	|| (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   shard: shard to reserve slots of, locked by the caller.
+ *   need: slots wanted, at most the shard's maxSize.
+ *   deadline: as for pin_batch().
+ * @ret: 0 once the slots are added to the shard's 'reserved', -1 if the deadline passed first.
+ *
+ * Notes:
+ * Reserves right away if nobody is queued and the room is there. Otherwise the batch queues up
+ * behind the ones already waiting and sleeps on a condition variable of its own until
+ * admit_grant() gets to it, so a freed slot wakes only a waiter it is enough for. The flusher is
+ * kicked while dirty slots could make room. Returns with the shard locked.
+ */
+static int admit_wait(file_cache *cache, struct __cache_shard *shard, int need,
+		      const struct timespec *deadline)
+{
+    struct __admit a, *prev;
+    pthread_condattr_t attr;
+    struct timespec start;
+    int ret = 0;
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <sys/types.h>
-#include <pthread.h>
-#include "file_cache.h"
+    if ( !shard->admitHead && shard_room(shard) >= need ) {
+	shard->reserved += need;
+	return 0;
+    }
+    if ( deadline && deadline_passed(deadline) )
+	return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    shard->stats.pinWaits++;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&a.cv, &attr);
+    pthread_condattr_destroy(&attr);
+    a.need = need;
+    a.granted = 0;
+    a.next = NULL;
+    if ( shard->admitTail )
+	shard->admitTail->next = &a;
+    else
+	shard->admitHead = &a;
+    shard->admitTail = &a;
+
+    while ( !a.granted ) {
+	dbug_p("WAITING ....\n"); //ABHI
+	if ( shard->dirtyHead >= 0 )
+	    flusher_kick(cache);
+	if ( !deadline )
+	    pthread_cond_wait(&a.cv, &shard->lock);
+	else if ( ETIMEDOUT == pthread_cond_timedwait(&a.cv, &shard->lock, deadline) && !a.granted ) {
+	    prev = NULL;              /* Leave the queue */
+	    if ( shard->admitHead == &a )
+		shard->admitHead = a.next;
+	    else {
+		for ( prev = shard->admitHead; prev->next != &a; prev = prev->next )
+		    ;
+		prev->next = a.next;
+	    }
+	    if ( shard->admitTail == &a )
+		shard->admitTail = prev;
+	    admit_grant(shard);       /* The batches behind may fit now */
+	    ret = -1;
+	    break;
+	}
+    }
+    hist_add(shard->stats.waitLatency, usec_since(&start));
+    pthread_cond_destroy(&a.cv);
+    return ret;
+}
+
+/* @param: pins, nPins: the pins a batch holds so far.
+ *   shard: shard to count them in.
+ * @ret: number of the pins on slots of the shard.
+ */
+static int batch_pins(const struct __pin *pins, int nPins, const struct __cache_shard *shard)
+{
+    int i, n = 0;
 
-#define CACHE_SIZE 10240     /* 10 Kb = 10*1024 Bytes */
+    for ( i = 0; i < nPins; i++ ) {
+	if ( pins[i].shard == shard && pins[i].slot >= 0 )
+	    n++;
+    }
+    return n;
+}
 
-pthread_mutex_t metaLock = PTHREAD_MUTEX_INITIALIZER;    /* Mutex used in constructor to facilitate singelton instance */
-pthread_mutex_t pinLock;  				 /* Mutex used in pin & unpin to searially access file_cache DS */
-pthread_cond_t slotcv;	     			         /* Condition variable to signal if cache has empty slot */
+/* @param: cache: pointer to file_cache structure.
+ *   shard: shard a batch is about to wait on for room, locked by the caller.
+ *   mine: pins the batch holds on slots of the shard, see batch_pins().
+ * @ret: 1 if another thread holds a pin in the shard or a dirty slot is on its way to the LRU
+ *   list, so that waiting can bring room. 0 if every pin in the shard is the batch's own.
+ */
+static int shard_busy(file_cache *cache, struct __cache_shard *shard, int mine)
+{
+    int slot, last = shard->firstSlot + shard->maxSize, pins = 0;
 
-/* @param: int max_cache_entries: Maximum entries in the file cache.
- * @ret: file_cache* poniter to file_cache structure. 
+    if ( shard->dirtySize > 0 )
+	return 1;
+    for ( slot = shard->firstSlot; slot < last; slot++ ) {
+	if ( cache->nodeHead[slot].flushing )
+	    return 1;
+	pins += cache->nodeHead[slot].refCount;
+    }
+    return pins > mine;
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   shard: shard owning the slot, locked by the caller.
+ *   slot: slot of the file in the index, loaded or still being read in.
+ *   file: index of the file in the batch.
+ *   pins, nPins, waits, nWaits: the batch's pins, and the pins on slots still being read.
+ *   prefetch: 1 if the batch is a read ahead, see prefetch_one().
  * Notes:
- * This the constructor for the user level file cache. 
- * It initializes the file_cache structure which contains the metadata for the file cache.
- * There will be only one instance of the file_cache at a time in process address space.
- * Client are expected to use the function pointers perform operation on the file cache.
+ * Takes a pin on the slot for the batch, off the LRU or dirty list if it had none. The slot is
+ * marked hot unless this is its first real pin since a prefetch read it in, or a prefetch itself.
+ * A real pin of a loaded slot counts as a hit, one of a slot still being read in as a miss;
+ * a prefetch counts as neither.
  */
-file_cache *file_cache_construct(int max_cache_entries)
+static void pin_take(file_cache *cache, struct __cache_shard *shard, int slot, int file,
+		     struct __pin *pins, int *nPins, struct __load_job *waits, int *nWaits, int prefetch)
 {
-    static file_cache *fileCachePt = NULL;
+    struct __node_cache *node = &cache->nodeHead[slot];
+
+    if ( 0 == node->refCount ) { /* Resident but unpinned */
+	slot_unlist(cache, shard, slot);
+	__atomic_add_fetch(&cache->currentSize, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&node->refCount, node->refCount + 1, __ATOMIC_RELAXED);
+    if ( !prefetch ) {                  /* A read ahead is no reference */
+	if ( node->prefetched )         /* First real pin since a prefetch read it in */
+	    node->prefetched = 0;
+	else
+	    node->hot = 1;
+    }
+    if ( !prefetch ) {                  /* Joining a read in flight is a miss, not a hit */
+	if ( node->loading || node->loadFailed )
+	    shard->stats.misses++;
+	else
+	    shard->stats.hits++;
+    }
+    if ( node->loading || node->loadFailed ) { /* Another pin is still reading it */
+	waits[*nWaits].shard = shard;
+	waits[*nWaits].pin = *nPins;
+	waits[(*nWaits)++].slot = slot;
+    }
+    pins[*nPins].shard = shard;
+    pins[*nPins].slot = slot;
+    pins[(*nPins)++].file = file;
+}
 
-    pthread_mutex_lock(&metaLock);
+/* @param: cache: pointer to file_cache structure.
+ *   jobs, n: slots claimed by the batch.
+ *   pins: pins of the batch, the pin of each failed load is marked gone.
+ */
+static void pin_load(file_cache *cache, struct __load_job *jobs, int n, struct __pin *pins)
+{
+    int i;
 
-    if ( !fileCachePt ) {
-	fileCachePt = malloc(sizeof(struct file_cache));
-	if ( !fileCachePt )
-	    return NULL;
+    load_batch(cache, jobs, n);
+    for ( i = 0; i < n; i++ ) {
+	if ( jobs[i].ret )
+	    pins[jobs[i].pin].slot = -1;
+    }
+}
 
-	memset(fileCachePt, 0, sizeof(struct file_cache));
-	fileCachePt->maxSize = max_cache_entries;
-	fileCachePt->currentSize = 0;
-	fileCachePt->selfRef = &fileCachePt;
+/* A pin batch under way, see pin_batch(). The per file arrays are indexed like 'files' */
+struct __batch {
+    const char **files;
+    int num;                     /* Files in the batch */
+    unsigned int *hashes;        /* Hash of each name */
+    size_t *lens;                /* Length of each name */
+    int *fds;                    /* Descriptor opened for a file that isn't cached, -1 if none yet, or
+				    FC_PIN_SKIP, FC_PIN_DONE or FC_PIN_DUP */
+    size_t *sizes;               /* Size of each file opened */
+    int *found;                  /* Slot each file of the shard being pinned was found in, -1 if none */
+    int *slots;                  /* Slot batch_place() set aside for each miss, -1 if none */
+    int held[FC_MAX_SHARDS];     /* Slots reserved per shard index and not taken yet */
+    struct __load_job *jobs;     /* Misses claimed and not read yet */
+    struct __load_job *waits;    /* Pins on slots another pin is reading */
+    struct __pin *pins;          /* Every pin taken, see pin_take() */
+    int nJobs, nWaits, nPins;
+    int prefetch;                /* Read ahead by prefetch_one(), its misses are not referenced yet */
+};
 
-	fileCachePt->nodeHead = malloc(max_cache_entries *(sizeof(struct __node_cache)));
-	if ( !fileCachePt->nodeHead ) {
-	    free(fileCachePt);
-	    fileCachePt = NULL;
-    	    pthread_mutex_unlock(&metaLock);
-	    return NULL;
+/* @param: cache: pointer to file_cache structure.
+ *   b: the batch.
+ *   shard: one of its shards, locked by the caller.
+ * @ret: 1 if the lock was dropped to open files, so the caller has to look again. 0 if found[] is
+ *   up to date and every file of the shard that isn't cached has its descriptor.
+ * Notes:
+ * Looks each file of the shard up into found[]. The files that aren't cached and have no
+ * descriptor yet are then opened, and their size taken, without the lock. A file missing on disk
+ * is created (not by a prefetch, which only reads ahead) and, like one too big for the shard,
+ * marked FC_PIN_SKIP: it is never pinned.
+ * Returns with the shard locked.
+ */
+static int batch_scan(file_cache *cache, struct __batch *b, struct __cache_shard *shard)
+{
+    struct stat st;
+    int i, open = 0;
+
+    for ( i = 0; i < b->num; i++ ) {
+	if ( shard_of(cache, b->hashes[i]) != shard )
+	    continue;
+	b->found[i] = -1;
+	if ( b->fds[i] < -1 )
+	    continue;
+	b->found[i] = index_find(cache, shard, b->files[i], b->hashes[i], b->lens[i]);
+	if ( b->found[i] < 0 && b->fds[i] < 0 )
+	    open = 1;
+    }
+    if ( !open )
+	return 0;
+
+    pthread_mutex_unlock(&shard->lock);
+    for ( i = 0; i < b->num; i++ ) {
+	if ( shard_of(cache, b->hashes[i]) != shard || -1 != b->fds[i] || b->found[i] >= 0 )
+	    continue;
+	b->fds[i] = file_open(b->files[i]);
+	if ( b->fds[i] < 0 ) { /* File not present. Create on Disk with 10 Kb '\0' */
+	    if ( ENOENT == errno && !b->prefetch )
+		file_create(b->files[i]);
+	    b->fds[i] = FC_PIN_SKIP;
+	}
+	else if ( fstat(b->fds[i], &st) || !buf_fits(cache, shard, st.st_size) ) { /* Too big to cache */
+	    dbug_p("CANT CACHE:%s:\n", b->files[i]);
+	    close(b->fds[i]);
+	    b->fds[i] = FC_PIN_SKIP;
 	}
+	else
+	    b->sizes[i] = st.st_size;
+    }
+    pthread_mutex_lock(&shard->lock);
+    return 1;
+}
 
-	memset(fileCachePt->nodeHead,  0, max_cache_entries *(sizeof(struct __node_cache)));
-	fileCachePt->file_cache_destroy = file_cache_destroy; 
-	fileCachePt->file_cache_pin_files = file_cache_pin_files;
-	fileCachePt->file_cache_unpin_files = file_cache_unpin_files;
-	fileCachePt->file_cache_file_data = file_cache_file_data;
-	fileCachePt->file_cache_mutable_file_data = file_cache_mutable_file_data;
+/* @param: cache: pointer to file_cache structure.
+ *   b: the batch, its found[] up to date for the shard, see batch_scan().
+ *   shard: one of its shards, locked by the caller.
+ * @ret: number of slots the batch needs reserved in the shard: one for each of its files there
+ *   that isn't pinned, cached or not. Pinned files are hits that take no room.
+ */
+static int batch_need(file_cache *cache, const struct __batch *b, struct __cache_shard *shard)
+{
+    int i, need = 0;
 
-	pthread_mutex_init(&pinLock, NULL);
-	pthread_cond_init (&slotcv, NULL);
+    for ( i = 0; i < b->num; i++ ) {
+	if ( shard_of(cache, b->hashes[i]) == shard && b->fds[i] >= -1
+	     && (b->found[i] < 0 || 0 == cache->nodeHead[b->found[i]].refCount) )
+	    need++;
     }
-    pthread_mutex_unlock(&metaLock);
-    return fileCachePt;
+    return need;
 }
-/* @param: file_cache* cache: pointer to file cache structure.
- * @ret: void
- * Notes: 
- *   This is the destructor for the file_cache and frees all allocated
- * memory on heap starting from the bottom i.e. 10Kb cache pages, then
- * name then the array of structure (struct __node_cache) and finally 
- * file_cache structure itself.
- * Also desstroys the mutex and condition variables initialized.
- *
+
+/* @param: cache: pointer to file_cache structure.
+ *   b: the batch, its found[] up to date for the shard.
+ *   shard: shard it needs room in, locked by the caller.
+ *   own: 0 to pass over the files of the batch, 1 to take only them.
+ * @ret: the slot to evict next: the oldest on probation before the oldest protected. -1 if there
+ *   is none.
  */
+static int batch_victim(file_cache *cache, const struct __batch *b, struct __cache_shard *shard, int own)
+{
+    int i, slot, list;
 
-void file_cache_destroy(file_cache *cache)
+    for ( list = 0; list < 2; list++ ) {
+	for ( slot = list ? shard->protHead : shard->lruHead; slot >= 0; slot = cache->nodeHead[slot].lruNext ) {
+	    for ( i = 0; i < b->num && b->found[i] != slot; i++ )
+		;
+	    if ( (i < b->num) == own )
+		return slot;
+	}
+    }
+    return -1;
+}
+
+/* @param: cache: pointer to file_cache structure.
+ *   b: the batch, its found[] up to date for the shard and its slots[] all -1.
+ *   shard: one of its shards, locked by the caller.
+ * @ret: -1 once every miss of the batch in the shard has a free slot with a buffer of its size in
+ *   slots[]. Otherwise, with nothing set aside, the index of a miss no room was found for, or -3
+ *   if a cached file of the batch was evicted to make room, so it has to be opened as a miss.
+ * Notes:
+ * The misses are placed largest first, evicting the LRU slots of other files as needed. If one
+ * doesn't fit, the buffers set aside are given back, and if that attempt evicted anything the
+ * misses are placed again: the buffers of the batch itself may have split the room the evictions
+ * made, which is in one piece once they are given back. Once no other file is left to evict, the
+ * unpinned files of the batch itself are, as a buffer of theirs may split the room just as well.
+ */
+static int batch_fit(file_cache *cache, struct __batch *b, struct __cache_shard *shard)
 {
-    int size, i;
-    FILE *filePt;
+    int i, j, slot, bad, evicted;
 
-    if ( !cache )
-	return;
+    do {
+	bad = -1;
+	evicted = 0;
+	for ( ;; ) {
+	    for ( i = -1, j = 0; j < b->num; j++ ) {     /* Largest miss not placed yet */
+		if ( shard_of(cache, b->hashes[j]) == shard && b->fds[j] >= 0 && b->found[j] < 0
+		     && b->slots[j] < 0 && (i < 0 || b->sizes[j] > b->sizes[i]) )
+		    i = j;
+	    }
+	    if ( i < 0 )
+		break;
+	    while ( b->slots[i] < 0 ) {
+		if ( shard->freeHead >= 0 && !buf_alloc(cache, shard, &cache->nodeHead[shard->freeHead], b->sizes[i]) ) {
+		    b->slots[i] = free_pop(cache, shard);
+		    break;
+		}
+		slot = batch_victim(cache, b, shard, 0);
+		if ( slot < 0 ) {
+		    if ( !evicted && (slot = batch_victim(cache, b, shard, 1)) >= 0 )
+			bad = -3;
+		    break;
+		}
+		evict_slot(cache, shard, slot);
+		evicted = 1;
+	    }
+	    if ( -3 == bad ) {                           /* A file of the batch, now a miss */
+		for ( j = 0; b->found[j] != slot; j++ )
+		    ;
+		b->found[j] = -1;
+		evict_slot(cache, shard, slot);
+		break;
+	    }
+	    if ( b->slots[i] < 0 ) {
+		bad = i;
+		break;
+	    }
+	}
+	for ( j = 0; bad != -1 && j < b->num; j++ ) {
+	    if ( b->slots[j] >= 0 ) {
+		buf_free(cache, shard, &cache->nodeHead[b->slots[j]]);
+		free_push(cache, shard, b->slots[j]);
+		b->slots[j] = -1;
+	    }
+	}
+    } while ( bad >= 0 && evicted );
+    return bad;
+}
 
-    pthread_mutex_lock(&metaLock);
+/* @param: cache: pointer to file_cache structure.
+ *   b: the batch, its found[] up to date for the shard, see batch_scan().
+ *   shard: one of its shards, locked by the caller.
+ *   k: index of the shard. held[k] covers the slots the files of the batch there are going to take.
+ * @ret: -1 once every file of the batch in the shard is pinned, the misses claimed for
+ *   load_batch(). Otherwise none of them is: the index of a miss no room was found for, -2 if
+ *   a name couldn't be stored (out of memory), or -3 if a file of the batch was evicted for room
+ *   and has to be looked up again, see batch_fit().
+ *
+ * Notes:
+ * All or nothing per shard. First every miss gets a free slot with a buffer of its size, see
+ * batch_fit(). If one doesn't fit, none is set aside. Only then are the files pinned: the cached ones off their LRU or dirty list,
+ * and the misses claimed. So a batch never holds a pin in a shard it still waits on for room.
+ * The files of the shard beyond the slots reserved, when a batch has more of them than the shard
+ * has slots, are never pinned.
+ */
+static int batch_place(file_cache *cache, struct __batch *b, struct __cache_shard *shard, int k)
+{
+    struct __node_cache *node;
+    int i, j, slot, used = 0, bad;
 
-    size = cache->maxSize;
-    i = 0;
+    for ( i = 0; i < b->num; i++ ) {
+	b->slots[i] = -1;
+	if ( shard_of(cache, b->hashes[i]) != shard || b->fds[i] < -1 )
+	    continue;
+	j = b->found[i];
+	if ( j >= 0 && (cache->nodeHead[j].refCount > 0 || !slot_evictable(&cache->nodeHead[j])) )
+	    continue;                            /* Pinned or dirty, it takes no slot */
+	if ( used == b->held[k] ) {
+	    if ( b->fds[i] >= 0 )
+		close(b->fds[i]);
+	    b->fds[i] = FC_PIN_SKIP;
+	    continue;
+	}
+	used++;
+    }
+    bad = batch_fit(cache, b, shard);
+    if ( bad != -1 )
+	return bad;
 
-    while ( i < size ) {  /* Free the cache and name in each nodeCache */
-	if ( cache->nodeHead[i].dirty ) { /* Flush back to Disk */ 
-	    filePt = fopen(cache->nodeHead[i].name, "w");
-	    if ( !filePt ) {  /* Can't Open file to write to,error out without modifying any metadata */
-		pthread_mutex_unlock(&metaLock);
-		return;
+    for ( i = 0; i < b->num; i++ ) {
+	if ( shard_of(cache, b->hashes[i]) != shard || b->fds[i] < -1 )
+	    continue;
+	if ( b->slots[i] < 0 ) { /* Cache Hit */
+	    j = b->found[i];
+	    node = &cache->nodeHead[j];
+	    if ( 0 == node->refCount && slot_evictable(node) ) { /* Takes a reserved slot off the LRU list */
+		b->held[k] -= 1;
+		shard->reserved -= 1;
 	    }
-	    fwrite(cache->nodeHead[i].cache, 1, CACHE_SIZE, filePt);
-	    fclose(filePt);
+	    pin_take(cache, shard, j, i, b->pins, &b->nPins, b->waits, &b->nWaits, b->prefetch);
+	    dbug_p("CACHE HIT for :%s: RefCount:%d:\n", b->files[i], node->refCount);
+	    if ( b->fds[i] >= 0 )
+		close(b->fds[i]);
+	    b->fds[i] = FC_PIN_DONE;
+	    continue;
 	}
 
-	free(cache->nodeHead[i].name);
-	free(cache->nodeHead[i].cache);
-	i++;
+	/* Cache Miss, the slot has its buffer: claim it, read it with the rest of the batch */
+	dbug_p("CACHE MISS:%d\n", shard->currentSize);
+	slot = b->slots[i];
+	node = &cache->nodeHead[slot];
+	if ( slot_set_name(shard, node, b->files[i]) ) { /* Cant allocate memory, error out */
+	    for ( ; i < b->num; i++ ) {
+		if ( b->slots[i] >= 0 ) {
+		    buf_free(cache, shard, &cache->nodeHead[b->slots[i]]);
+		    free_push(cache, shard, b->slots[i]);
+		}
+	    }
+	    return -2;
+	}
+	b->slots[i] = -1;
+	b->held[k] -= 1;
+	shard->reserved -= 1;
+	node->refCount = 1;
+	node->hash = b->hashes[i];
+	node->loading = 1;                  /* set before index_add() publishes the slot */
+	node->prefetched = b->prefetch;
+	index_add(cache, shard, slot);
+	shard->currentSize += 1;
+	if ( b->prefetch )
+	    shard->stats.prefetches++;
+	else
+	    shard->stats.misses++;
+	__atomic_add_fetch(&cache->currentSize, 1, __ATOMIC_RELAXED);
+	b->jobs[b->nJobs].shard = shard;
+	b->jobs[b->nJobs].fd = b->fds[i];
+	b->jobs[b->nJobs].pin = b->nPins;
+	b->jobs[b->nJobs++].slot = slot;
+	b->pins[b->nPins].shard = shard;
+	b->pins[b->nPins].slot = slot;
+	b->pins[b->nPins++].file = i;
+	b->fds[i] = FC_PIN_DONE;
     }
 
-    /* Now free nodeCache itself */
-    free(cache->nodeHead);
+    /* A file named twice shares the pin of its first one */
+    for ( i = 0; i < b->num; i++ ) {
+	if ( shard_of(cache, b->hashes[i]) != shard || FC_PIN_DUP != b->fds[i] )
+	    continue;
+	j = index_find(cache, shard, b->files[i], b->hashes[i], b->lens[i]);
+	if ( j >= 0 && cache->nodeHead[j].refCount > 0 ) {
+	    pin_take(cache, shard, j, i, b->pins, &b->nPins, b->waits, &b->nWaits, b->prefetch);
+	    b->fds[i] = FC_PIN_DONE;
+	}
+	else
+	    b->fds[i] = FC_PIN_SKIP;
+    }
+    return -1;
+}
 
-    /* Setting the static pointer in construct call to NULL */
-    *(cache->selfRef) = NULL;
+/* @param: cache: pointer to file_cache structure.
+ *   b: the batch, no shard locked.
+ * Notes:
+ * Reads the misses claimed so far, see pin_load(). A batch does so before it waits on anything,
+ * as other pins may be waiting on those reads.
+ */
+static void batch_load(file_cache *cache, struct __batch *b)
+{
+    pin_load(cache, b->jobs, b->nJobs, b->pins);
+    b->nJobs = 0;
+}
 
-    /* Just to make sure that all dangling refrences will seg fault after this */
-    memset(cache, 0, sizeof(struct file_cache));
+/* @param: cache: pointer to file_cache structure.
+ *   files, num_files: the batch, as for file_cache_pin_files().
+ *   deadline: absolute CLOCK_MONOTONIC time after which the batch gives up instead of waiting for
+ *     another thread, or NULL to wait as long as it takes. A deadline in the past never waits.
+ *   pinned: if not NULL, set to 1 for each file that ends up pinned and 0 for the others.
+ *   handles: if not NULL, set to the slot of each file that ends up pinned, FILE_CACHE_NO_HANDLE
+ *     for the others.
+ *   prefetch: 1 for a read ahead, which neither makes a file hot nor counts as its first
+ *     reference, see pin_take().
+ * @ret: number of files pinned, or -1 if the deadline passed (or memory ran out) and no file of the
+ *   batch is left pinned.
+ *
+ * Notes:
+ * Every pin taken is recorded in 'pins'. When the batch fails, the misses it claimed are still read,
+ * as other pinners may be waiting on them, and then each pin is dropped the way the state of its
+ * slot calls for, see slot_drop(). The misses stay resident and unpinned, like any unpinned file.
+ */
+static int pin_batch(file_cache *cache, const char **files, int num_files,
+		     const struct timespec *deadline, char *pinned, file_cache_handle *handles, int prefetch)
+{
+    dbug_p("Entering PINING:\n");
+    struct __load_job stackJobs[2 * FC_PIN_STACK];
+    struct __pin stackPins[FC_PIN_STACK];
+    unsigned int stackHashes[FC_PIN_STACK];
+    int stackFds[FC_PIN_STACK], stackFound[FC_PIN_STACK], stackSlots[FC_PIN_STACK];
+    size_t stackSizes[FC_PIN_STACK];
+    size_t stackLens[FC_PIN_STACK];
+    struct __batch b;
+    unsigned long long touched = 0;   /* Bit per shard index the batch has files in */
+    unsigned long long mask;
+    struct __cache_shard *shard;
+    struct __node_cache *node;
+    struct timespec start;
+    int i, k, s, need, bad, failed = 0, ret = 0;
 
-    /* Now free file_cache structure */
-    free(cache);
+    if ( pinned && num_files > 0 )
+	memset(pinned, 0, num_files);
+    for ( i = 0; handles && i < num_files; i++ )
+	handles[i] = FILE_CACHE_NO_HANDLE;
+    if ( !cache || !files || num_files <= 0 )
+	return 0;
+    b.files = files;
+    b.num = num_files;
+    b.jobs = stackJobs;
+    b.waits = stackJobs + FC_PIN_STACK;
+    b.pins = stackPins;
+    b.hashes = stackHashes;
+    b.fds = stackFds;
+    b.found = stackFound;
+    b.slots = stackSlots;
+    b.sizes = stackSizes;
+    b.lens = stackLens;
+    b.nJobs = b.nWaits = b.nPins = 0;
+    b.prefetch = prefetch;
+    if ( num_files > FC_PIN_STACK ) {
+	b.jobs = malloc(2 * num_files * sizeof(struct __load_job) + num_files * sizeof(struct __pin)
+			+ num_files * (2 * sizeof(size_t) + sizeof(unsigned int) + 3 * sizeof(int)));
+	if ( !b.jobs )
+	    return -1;
+	b.waits = b.jobs + num_files;
+	b.pins = (struct __pin *) (b.jobs + 2 * num_files);
+	b.sizes = (size_t *) (b.pins + num_files);
+	b.lens = b.sizes + num_files;
+	b.hashes = (unsigned int *) (b.lens + num_files);
+	b.fds = (int *) (b.hashes + num_files);
+	b.found = b.fds + num_files;
+	b.slots = b.found + num_files;
+    }
+    for ( i = 0; i < num_files; i++ ) {
+	b.hashes[i] = hash_name(files[i], &b.lens[i]);
+	for ( s = 0; s < i && (b.hashes[s] != b.hashes[i] || b.lens[s] != b.lens[i]
+			       || memcmp(files[s], files[i], b.lens[i])); s++ )
+	    ;
+	b.fds[i] = s < i ? FC_PIN_DUP : -1;
+	b.found[i] = b.slots[i] = -1;
+	b.sizes[i] = 0;
+	k = shard_of(cache, b.hashes[i]) - cache->shards;
+	b.held[k] = 0;
+	touched |= 1ULL << k;
+    }
+
+    /* A batch reserves every slot it is going to take in a shard before it takes any, and it
+     * pins the files of a shard all at once, with their buffers set aside, before it goes on to
+     * the next. The shards are taken in ascending order, and before it waits on anything the batch
+     * reads the misses it claimed so far, as other pins may be waiting on them. So a batch only
+     * ever waits on a shard with pins in lower shards held, never in that one or a higher one, and
+     * two batches can't each hold part of what the other needs: no cycle of waits can form.
+     *
+     * Files that are pinned are hits that take no room. Every other file, not cached or cached
+     * but unpinned, gets a slot reserved through the admission queue, see admit_wait(). Once the
+     * reservation is granted the need is counted again, and in the same hold of the lock
+     * batch_place() finds each miss a buffer, evicting LRU slots, and pins the lot. A shard with
+     * the slots but not the bytes for the misses is waited on through slotcv with the reservation
+     * held, and with no pin in it. If nobody else holds a pin there waiting can't bring room:
+     * batch_fit() evicted everything it could, the batch's own files included, so the misses don't
+     * fit even the empty arena, and the file is not pinned, like a file too big to cache.
+     */
+    for ( mask = touched; mask && !failed; mask &= mask - 1 ) {
+	k = __builtin_ctzll(mask);
+	shard = &cache->shards[k];
+	pthread_mutex_lock(&shard->lock);     /* take the shard lock before modifying its slots */
+	for ( ;; ) {
+	    if ( batch_scan(cache, &b, shard) )
+		continue;
+	    need = batch_need(cache, &b, shard);
+	    if ( need > shard->maxSize )      /* Can't ever fit, it waits for the whole shard */
+		need = shard->maxSize;
+	    if ( b.held[k] < need ) {
+		if ( b.held[k] > 0 ) {        /* More files got unpinned meanwhile, queue up again */
+		    shard->reserved -= b.held[k];
+		    b.held[k] = 0;
+		    admit_grant(shard);
+		}
+		if ( b.nJobs > 0 && (shard->admitHead || shard_room(shard) < need) ) {
+		    pthread_mutex_unlock(&shard->lock);
+		    batch_load(cache, &b);
+		    pthread_mutex_lock(&shard->lock);
+		    continue;
+		}
+		if ( admit_wait(cache, shard, need, deadline) ) {
+		    failed = 1;
+		    break;
+		}
+		b.held[k] = need;
+		continue;
+	    }
+	    if ( b.held[k] > need ) {
+		shard->reserved -= b.held[k] - need;
+		b.held[k] = need;
+		admit_grant(shard);
+	    }
+
+	    bad = batch_place(cache, &b, shard, k);
+	    if ( -1 == bad )
+		break;
+	    if ( -3 == bad )                  /* One of its files was evicted, open it as a miss */
+		continue;
+	    if ( -2 == bad ) {
+		failed = 1;
+		break;
+	    }
+	    if ( !shard_busy(cache, shard, batch_pins(b.pins, b.nPins, shard)) ) {
+		dbug_p("CANT PLACE:%s:\n", files[bad]);  /* Only its own pins hold the room */
+		close(b.fds[bad]);
+		b.fds[bad] = FC_PIN_SKIP;
+		continue;
+	    }
+	    if ( b.nJobs > 0 ) {
+		pthread_mutex_unlock(&shard->lock);
+		batch_load(cache, &b);
+		pthread_mutex_lock(&shard->lock);
+		continue;
+	    }
+	    if ( deadline && deadline_passed(deadline) ) {
+		failed = 1;
+		break;
+	    }
+	    dbug_p("WAITING ....\n"); //ABHI
+	    if ( shard->dirtyHead >= 0 )
+		flusher_kick(cache);
+	    shard->stats.pinWaits++;
+	    clock_gettime(CLOCK_MONOTONIC, &start);
+	    if ( !deadline )
+		pthread_cond_wait(&shard->slotcv, &shard->lock);
+	    else if ( ETIMEDOUT == pthread_cond_timedwait(&shard->slotcv, &shard->lock, deadline) )
+		failed = 1;
+	    hist_add(shard->stats.waitLatency, usec_since(&start));
+	    if ( failed )
+		break;
+	}
+	pthread_mutex_unlock(&shard->lock);
+    }
 
-    pthread_mutex_unlock(&metaLock);
+    /* Close what a failed batch opened ahead, and give back the reservations left over, e.g. by
+     * files pinned by another thread meanwhile */
+    for ( i = 0; i < num_files; i++ ) {
+	if ( b.fds[i] >= 0 )
+	    close(b.fds[i]);
+    }
+    for ( mask = touched; mask; mask &= mask - 1 ) {
+	k = __builtin_ctzll(mask);
+	if ( b.held[k] > 0 ) {
+	    pthread_mutex_lock(&cache->shards[k].lock);
+	    cache->shards[k].reserved -= b.held[k];
+	    admit_grant(&cache->shards[k]);
+	    pthread_mutex_unlock(&cache->shards[k].lock);
+	}
+    }
+
+    /* Read all the misses at once, then wait for the files other pins were reading. A batch that
+     * gave up still reads its claims in, other pins may be waiting on them */
+    batch_load(cache, &b);
+    for ( i = 0; i < b.nWaits && !failed; i++ ) {
+	shard = b.waits[i].shard;
+	node = &cache->nodeHead[b.waits[i].slot];
+	pthread_mutex_lock(&shard->lock);
+	while ( node->loading && !failed ) {
+	    if ( !deadline )
+		pthread_cond_wait(&shard->loadcv, &shard->lock);
+	    else if ( ETIMEDOUT == pthread_cond_timedwait(&shard->loadcv, &shard->lock, deadline) )
+		failed = node->loading;
+	}
+	if ( !failed && node->loadFailed ) {   /* Unreadable, so not pinned for us either */
+	    slot_unclaim(cache, shard, b.waits[i].slot);
+	    b.pins[b.waits[i].pin].slot = -1;
+	}
+	pthread_mutex_unlock(&shard->lock);
+    }
 
-    pthread_mutex_destroy(&pinLock);
-    pthread_cond_destroy(&slotcv);
+    for ( i = 0; i < b.nPins; i++ ) {
+	if ( b.pins[i].slot < 0 )
+	    continue;
+	if ( failed ) {
+	    pthread_mutex_lock(&b.pins[i].shard->lock);
+	    slot_drop(cache, b.pins[i].shard, b.pins[i].slot);
+	    pthread_mutex_unlock(&b.pins[i].shard->lock);
+	    continue;
+	}
+	if ( pinned )
+	    pinned[b.pins[i].file] = 1;
+	if ( handles )
+	    handles[b.pins[i].file] = b.pins[i].slot;
+	ret++;
+    }
+
+    if ( b.jobs != stackJobs )
+	free(b.jobs);
+    dbug_p("Leaving PINNING:\n");
+    return failed ? -1 : ret;
 }
 
 /* @param:
@@ -166,109 +3580,236 @@ void file_cache_destroy(file_cache *cache)
  *
  * Notes:
  * This function tries to pin(read) files into file_cache.
- * If there is a cache hit i.e. file is already pinned then we just increase the refCount of the file
+ * If there is a cache hit i.e. file is already cached then we just increase the refCount of the file,
+ * taking it off the LRU list if it was resident but unpinned.
  * If there is a cache miss i.e. file is not in cache, there are two scenarios:
  *
- *     a. File is present on the secondary storage, it is read into an empty cache slot and corresponding refcount
- *	  and currentSize of cache are incremented.
+ *     a. File is present on the secondary storage, it is read into an empty cache slot popped off the shard's
+ *	  free list, with a buffer of the file's size, and corresponding refcount and currentSize of cache are
+ *	  incremented. While the shard has no empty slot or no room for the buffer, the least recently used
+ *	  clean unpinned slot is evicted. A file bigger than the shard could ever hold is not pinned, nor is
+ *	  one that doesn't fit next to the files the batch pinned itself when no other pin is held.
  *     b. If file in not present on secondary storage a new file is created of size 10Kb and written with '\0'.
  *        In this case it is *NOT* read into cache.
  *
- * If there are no empty slots in the file_cache i.e. maxSize == currentSize in the case of a cache miss,
- * the thread blocks on a condition variable 'slotcv' which is signaled from file_cache_unpin_files() 
- * if a slot is unpined and is ready to be used.
- * At a time only one thread can enter the critical section in this function and can therby modify the file_cache DS.
+ * Misses are not read under the shard lock. Each miss claims its slot, which is indexed under the file's
+ * name and marked 'loading', and once the whole batch is claimed load_batch() reads all of them at once.
+ * A thread pinning a file that is still loading takes its pin right away and waits on the shard's
+ * 'loadcv' at the end of its own batch. If the load fails, all the pins taken on it are dropped again.
+ *
+ * Before pinning anything the batch reserves a slot for each of its files that isn't pinned, through the
+ * admission queue of the file's shard. If every slot in the shard is pinned, dirty or reserved, the thread
+ * kicks the flusher and sleeps in the queue until file_cache_unpin_files() or the flusher makes enough
+ * room for it and everyone queued ahead of it. Shards are taken in ascending order and the files of one
+ * shard are placed all at once, so the batch never waits while holding pins in the shard it waits on.
+ * Each file is pinned under the lock of its own shard, so only pins of files of the same shard serialize.
+ * See pin_batch(), which also backs file_cache_try_pin_files() and file_cache_timed_pin_files().
  *
  */
 
 void file_cache_pin_files(file_cache *cache, const char **files, int num_files)
 {
-    dbug_p("Entering PINING:\n");
-    const char *fName = NULL;
-    int i, j, nameLen, hit, freeIndex, ret;
-    FILE *filePt;
+    pin_batch(cache, files, num_files, NULL, NULL, NULL, 0);
+}
 
-    if ( !cache || !files || 0 == num_files )
-	return;
+/* @param:
+ *  *cache: poniter to file_cache structure (meta data)
+ *  **files, num_files: files to be pinned, as for file_cache_pin_files().
+ *  *pinned: NULL, or num_files flags set to 1 for each file pinned.
+ * @ret: number of files pinned, or -1 if the batch would have to wait and nothing was pinned.
+ *
+ * Notes:
+ * Pins like file_cache_pin_files() but never waits on another thread: not for a slot to be unpinned
+ * or flushed, nor for a read another pin has in flight. The misses of the batch are still read.
+ */
+int file_cache_try_pin_files(file_cache *cache, const char **files, int num_files, char *pinned)
+{
+    struct timespec past = { 0, 0 };
 
-    pthread_mutex_lock(&pinLock);                 /* take the lock before modifying file_cache */
+    return pin_batch(cache, files, num_files, &past, pinned, NULL, 0);
+}
 
-    for ( i = 0; i < num_files; i++ ) {
-	fName = files[i];
-	hit = 0;
+/* @param:
+ *  *cache: poniter to file_cache structure (meta data)
+ *  **files, num_files: files to be pinned, as for file_cache_pin_files().
+ *  timeout_ms: longest time to wait on other threads, in milliseconds. 0 is the same as a try pin.
+ *  *pinned: NULL, or num_files flags set to 1 for each file pinned.
+ * @ret: number of files pinned, or -1 if the timeout expired and nothing was pinned.
+ */
+int file_cache_timed_pin_files(file_cache *cache, const char **files, int num_files, int timeout_ms,
+			       char *pinned)
+{
+    struct timespec deadline;
 
-	for ( j = 0; j < cache->currentSize; j++ ) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    if ( timeout_ms > 0 ) {
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+	if ( deadline.tv_nsec >= 1000000000 ) {
+	    deadline.tv_sec += 1;
+	    deadline.tv_nsec -= 1000000000;
+	}
+    }
+    return pin_batch(cache, files, num_files, &deadline, pinned, NULL, 0);
+}
 
-	    if ( 0 == cache->nodeHead[j].refCount )	/* Empty slot we don't need to check this. */
-		continue;
+/* @param:
+ *  *cache: poniter to file_cache structure (meta data)
+ * @ret: 0 once every file dirty at the call is on disk, -1 if a writeback failed.
+ *
+ * Notes:
+ * Takes the next sync number, kicks the flusher and sleeps until a pass that started after the
+ * call is done, see flusher_main(). The syncs of many threads are served by one pass. The result
+ * is -1 if any writeback of that pass (or of a later one done by the time this thread wakes up)
+ * failed, so a failure is never missed but may be reported to a sync it didn't concern.
+ */
+int file_cache_sync(file_cache *cache)
+{
+    unsigned long gen;
+    int ret;
 
-	    if ( 0 == strcmp(fName, cache->nodeHead[j].name) ) { /* Cache Hit */ 
-		cache->nodeHead[j].refCount++;			
-		hit = 1;
-		dbug_p("CACHE HIT for :%s: RefCount:%d:\n", fName, cache->nodeHead[j].refCount);
-		break;
-	    }
+    if ( !cache )
+	return -1;
+    pthread_mutex_lock(&cache->flushLock);
+    gen = ++cache->syncReq;
+    __atomic_store_n(&cache->flushKick, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&cache->flushcv);
+    while ( cache->syncDone < gen )
+	pthread_cond_wait(&cache->synccv, &cache->flushLock);
+    ret = cache->syncFailed >= gen ? -1 : 0;
+    pthread_mutex_unlock(&cache->flushLock);
+    return ret;
+}
+
+/* @param:
+ *  *cache: poniter to file_cache structure (meta data)
+ *  *stats: filled in with the counters of the cache.
+ * @ret: void
+ *
+ * Notes:
+ * Sums the counters every shard keeps under its lock. The shards are read one after the other, so
+ * with other threads running the totals are close to, but not exactly, one point in time.
+ */
+void file_cache_get_stats(file_cache *cache, struct file_cache_stats *stats)
+{
+    struct __cache_shard *shard;
+    int i, b;
+
+    if ( !stats )
+	return;
+    memset(stats, 0, sizeof(*stats));
+    if ( !cache )
+	return;
+    for ( i = 0; i < cache->numShards; i++ ) {
+	shard = &cache->shards[i];
+	pthread_mutex_lock(&shard->lock);
+	stats->hits += shard->stats.hits;
+	stats->misses += shard->stats.misses;
+	stats->prefetches += shard->stats.prefetches;
+	stats->evictions += shard->stats.evictions;
+	stats->writebacks += shard->stats.writebacks;
+	stats->unchangedFlushes += shard->stats.unchangedFlushes;
+	stats->pinWaits += shard->stats.pinWaits;
+	stats->bytesRead += shard->stats.bytesRead;
+	stats->bytesWritten += shard->stats.bytesWritten;
+	for ( b = 0; b < FC_HIST_BUCKETS; b++ ) {
+	    stats->missLatency[b] += shard->stats.missLatency[b];
+	    stats->flushLatency[b] += shard->stats.flushLatency[b];
+	    stats->waitLatency[b] += shard->stats.waitLatency[b];
 	}
-	if ( 0 == hit ) { /* Cache Miss */
-	    dbug_p("CACHE MISS:%d\n", cache->currentSize);
-	    while ( cache->currentSize == cache->maxSize ) /* Cache is full, wait for a slot to open */ {
-		dbug_p("WAITING ....\n"); //ABHI
-		pthread_cond_wait(&slotcv, &pinLock);
-	    }
-	    dbug_p("CACHE MISS-UNLOCK:%d\n", cache->currentSize);
+	pthread_mutex_unlock(&shard->lock);
+    }
+}
 
-	    /* Get a free index in the file_cache */
-	    for ( freeIndex = 0; freeIndex < cache->maxSize; freeIndex++ ) {
-		if ( 0 == cache->nodeHead[freeIndex].refCount )
-		    break;
-	    }
-	    
-	    nameLen = strlen(fName) + 1;
-	    filePt = fopen(fName, "r");
+/* @param:
+ *  *cache: poniter to file_cache structure (meta data)
+ *  **files: poniter to array of char strings containing names of files to read ahead.
+ *  num_files: Number of files.
+ * @ret: void
+ *
+ * Notes:
+ * See prefetch_queue().
+ */
+void file_cache_prefetch_files(file_cache *cache, const char **files, int num_files)
+{
+    if ( !cache || !files || num_files <= 0 )
+	return;
+    prefetch_queue(cache, files, num_files, 0);
+}
 
-	    if ( filePt ) { /* Read and Map in cache-  Case a. as mentioned above in Notes  */
+/* @param:
+ *  *cache: poniter to file_cache structure (meta data)
+ * @ret: 0 if the manifest was written, -1 if the cache has none or it can't be written.
+ *
+ * Notes:
+ * Lists the resident files in cache->manifestPath for a later constructor to read back, most
+ * recently used first: one shard at a time under its lock, see manifest_shard(), and then taking
+ * the head of each shard's list in turn, as the shards keep no order between them. Files still
+ * queued from the last manifest follow, so a cache restarted before it warmed up keeps them.
+ * The manifest is written to a temporary file, synced and renamed over the old one, so that a
+ * crash leaves one or the other whole.
+ */
+int file_cache_save_manifest(file_cache *cache)
+{
+    char **names, **all, tmp[PATH_MAX];
+    int *first, *count, i, k, n = 0, m = 0, ret = -1;
+    struct __prefetch *pf;
+    FILE *fp;
 
-		cache->nodeHead[freeIndex].name = malloc(sizeof(char) * nameLen);
-		if ( !(cache->nodeHead[freeIndex].name) ) { /* Cant allocate memory, error out */
-		    fclose(filePt);
-    		    pthread_mutex_unlock(&pinLock);
-		    return;
-		}
-    		memset(cache->nodeHead[freeIndex].name, 0, nameLen);
-		strncpy(cache->nodeHead[freeIndex].name, fName, nameLen-1);
-
-		cache->nodeHead[freeIndex].cache = malloc(CACHE_SIZE); /* allocate memory of actual file cache */
-		if ( !(cache->nodeHead[freeIndex].cache) ) {/* Cant allocate memory, error out */
-		    free(cache->nodeHead[freeIndex].name);
-		    fclose(filePt);
-    		    pthread_mutex_unlock(&pinLock);
-		    return;
-		}
-    		memset(cache->nodeHead[freeIndex].cache, 0, CACHE_SIZE);
-		fread(cache->nodeHead[freeIndex].cache, 1, CACHE_SIZE, filePt); /* Read file into the cache */
-		fclose(filePt);
-		cache->nodeHead[freeIndex].refCount += 1;
-		cache->currentSize += 1;
-		dbug_p("PINNING:%s:\n", cache->nodeHead[freeIndex].name); //ABHI
-	    }
-	    else { /* File not present. Create on Disk with 10 Kb '\0' */
+    if ( !cache || !cache->manifestPath )
+	return -1;
+    if ( snprintf(tmp, sizeof(tmp), "%s.tmp", cache->manifestPath) >= (int) sizeof(tmp) )
+	return -1;
+    names = malloc(2 * cache->maxSize * sizeof(char *) + 2 * cache->numShards * sizeof(int));
+    if ( !names )
+	return -1;
+    all = names + cache->maxSize;
+    first = (int *) (all + cache->maxSize);
+    count = first + cache->numShards;
 
-		filePt = fopen(fName, "w+");
-		if ( !filePt ) {
-  		    pthread_mutex_unlock(&pinLock);
-		    return;
-		}
-		fclose(filePt); 
-		ret = truncate(fName, CACHE_SIZE);
-		dbug_p(" RET FROM TRUCN:%d\n", ret); // ABHI
-	    }
+    for ( k = 0; k < cache->numShards; k++ ) {
+	first[k] = n;
+	pthread_mutex_lock(&cache->shards[k].lock);
+	manifest_shard(cache, &cache->shards[k], names, &n, cache->maxSize);
+	pthread_mutex_unlock(&cache->shards[k].lock);
+	count[k] = n - first[k];
+    }
+    for ( i = 0; m < n; i++ ) {           /* Round robin over the shards, newest first in each */
+	for ( k = 0; k < cache->numShards; k++ ) {
+	    if ( i < count[k] )
+		all[m++] = names[first[k] + i];
+	}
+    }
+    if ( cache->numIoThreads ) {
+	pthread_mutex_lock(&cache->ioLock);
+	for ( pf = cache->pfHead; pf && m < cache->maxSize; pf = pf->next ) {
+	    if ( pf->warm )
+		names[n++] = all[m++] = strdup(pf->name);
+	}
+	pthread_mutex_unlock(&cache->ioLock);
+    }
 
+    fp = fopen(tmp, "w");
+    if ( fp ) {
+	fprintf(fp, "%s\n", FC_MANIFEST_MAGIC);
+	for ( i = 0; i < m; i++ ) {
+	    if ( all[i] )
+		fprintf(fp, "%s\n", all[i]);
 	}
+	if ( 0 == fflush(fp) && 0 == fsync(fileno(fp)) )
+	    ret = 0;
+	if ( fclose(fp) )
+	    ret = -1;
+	if ( !ret && rename(tmp, cache->manifestPath) )
+	    ret = -1;
+	if ( ret )
+	    unlink(tmp);
     }
-    dbug_p("Leaving PINNING:\n");
-    pthread_mutex_unlock(&pinLock); /* release the lock before returning */
+    for ( i = 0; i < n; i++ )
+	free(names[i]);
+    free(names);
+    return ret;
 }
-
 /* 
  * @param: *cache: poniter to file_cache structure (meta data)
  *   **file: poniter to char strings containing names of files to be UNpinned.
@@ -276,13 +3817,14 @@ void file_cache_pin_files(file_cache *cache, const char **files, int num_files)
  * @ret: void
  *
  * Notes:
- * This function UNpins the files if already pinned in the cache and release the memory in cache.
+ * This function UNpins the files if already pinned in the cache.
  * if there is a cache hit i.e. file is there in cache, there are two scenarios:
  *  1. refCount of the cache is 1:
- *      - Flush the cache into the file if present on disk and release memory else dont do anything.
+ *      - The slot stays resident with its data. A clean slot is put at the tail of the shard's LRU
+ *        list, and as it is now evictable a thread that may be waiting for a slot in this shard is
+ *        signaled. A dirty slot is put on the shard's dirty list for the background flusher, which
+ *        is kicked if flushHighWater dirty slots are waiting. No I/O is done here.
  *  2. If refCount is greater then 1, just decrement the refCount by 1 and return.
- *  After releasing the memory check if currentSize == maxSize, signal the process waiting for a free slot.
- *  Decrement the currentSize before signaling.
  *
  */
 
@@ -290,114 +3832,238 @@ void file_cache_unpin_files(file_cache *cache, const char **files, int num_files
 {
     dbug_p("Entering UNPINING:\n");
     const char *fName = NULL;
-    int i, j, loc;
-    FILE *filePt;
+    struct __cache_shard *shard;
+    int i, j;
+    unsigned int hash;
+    size_t len;
 
     if ( !cache || !files || 0 == num_files )
 	return;
 
-    pthread_mutex_lock(&pinLock);
-
     for ( i = 0; i < num_files; i++ ) {
 	fName = files[i];
+	hash = hash_name(fName, &len);
+	shard = shard_of(cache, hash);
 
-	for ( j = 0; j < cache->currentSize; j++ ) {
+	pthread_mutex_lock(&shard->lock);
 
-	    if ( 0 == cache->nodeHead[j].refCount )
-		continue;
-
-	    if ( 0 == strcmp(fName, cache->nodeHead[j].name) ) { /* Cache Hit */
-		loc = cache->nodeHead[j].refCount - 1; 
-		if ( 0 == loc ) { /* Can free the cach node */
-		    if ( cache->nodeHead[j].dirty ) { /* Flush back to Disk */ 
-			filePt = fopen(fName, "w");
-			if ( !filePt ) {  /* Can't Open file to write to,error out without modifying any metadata */
-			    pthread_mutex_unlock(&pinLock);
-			    return;
-			}
-			fwrite(cache->nodeHead[j].cache, 1, CACHE_SIZE, filePt);
-			fclose(filePt);
-		    }
-		    dbug_p("UNPINNING:%s:\n", cache->nodeHead[j].name); //ABHI
-		    free(cache->nodeHead[j].cache);
-		    free(cache->nodeHead[j].name);
-		    memset(&(cache->nodeHead[j]), 0, sizeof(struct __node_cache));
-
-		    if ( cache->currentSize == cache->maxSize ) {
-			dbug_p("SIZE ARE SAME:%d:%d:\n", cache->currentSize, cache->maxSize);
-			cache->currentSize -= 1;      /* Decrease the currentSize of file_cache */
-			pthread_cond_signal(&slotcv); /* Signal to any thread blocking for a free slot */
-		    }
-		    else
-			cache->currentSize -= 1;      /* Decrease the currentSize of file_cache */
-		}
-		else /* else just decrease the refcount */
-		    cache->nodeHead[j].refCount -= 1;
-	    }
+	j = index_find(cache, shard, fName, hash, len);
+	if ( j >= 0 && cache->nodeHead[j].refCount > 0 && !cache->nodeHead[j].loading
+	     && !cache->nodeHead[j].loadFailed ) { /* Cache Hit on a pinned file */
+	    slot_unpin(cache, shard, j);
 	}
+	pthread_mutex_unlock(&shard->lock);
     }
     dbug_p("LEAVINF UNPIN:\n");
-    pthread_mutex_unlock(&pinLock);
 }
 /* 
  * @param: *cache: pointer to file_cache structure (meta data).
  *    *file: const char * pointer to file name to read from cache.
- * @ret: const char * pointer to 10Kb in memory cache else NULL if not present.
+ * @ret: const char * pointer to the file's data in memory cache else NULL if not present.
  *
  * Notes:
- * This functions returnes a const char pointer to the 10Kb cache to the client if present in cache.
+ * This functions returnes a const char pointer to the file's cache to the client if pinned in cache.
+ * It holds file_cache_file_size() bytes. With file_cache_conf.padTo10Kb it is at least 10Kb long,
+ * zeros past the end of a shorter file, as every buffer was 10Kb before files had sizes of their own.
+ * Resident files that are not pinned return NULL, as their slot may be evicted at any time.
  * It is the responsibility of the client to synchronize the reads and writes to the file cache.
+ * The lookup takes no lock at all, index_read() keeps it safe against pins and unpins running
+ * in the same shard.
  * 
  */
 
 const char *file_cache_file_data(file_cache *cache, const char *file)
 {
-    char *ret_val = NULL;
-    int i;
+    unsigned int hash;
+    size_t size, len;
 
     if ( !cache || !file )
-	return;
+	return NULL;
 
-    for ( i = 0; i < cache->currentSize; i++ ) {
+    hash = hash_name(file, &len);
+    return index_read(cache, shard_of(cache, hash), file, hash, len, &size);
+}
 
-	if ( 0 == cache->nodeHead[i].refCount )
-	    continue;
-	if ( 0 == strcmp(file, cache->nodeHead[i].name) ) {
-		ret_val = cache->nodeHead[i].cache;
-		break;
-	}
+/* 
+ * @param: *cache: pointer to file_cache structure (meta data).
+ *    *file: const char * pointer to file name.
+ * @ret: bytes of the file's data in the cache, 0 if it is not pinned.
+ *
+ * Notes:
+ * The size is the one fstat() gave when the file was read in. The buffers returned by the data
+ * functions hold exactly this many bytes.
+ */
+size_t file_cache_file_size(file_cache *cache, const char *file)
+{
+    unsigned int hash;
+    size_t size = 0, len;
+
+    if ( !cache || !file )
+	return 0;
+
+    hash = hash_name(file, &len);
+    if ( !index_read(cache, shard_of(cache, hash), file, hash, len, &size) )
+	return 0;
+    return size;
+}
+
+/* @param: node: pinned and loaded slot, its shard locked by the caller.
+ *   offset, len: the bytes of the file the caller is going to write.
+ * @ret: the slot's buffer, to write to. NULL if it is the read-only mapping of a read-only file.
+ * Notes:
+ * Marks the range dirty. A slot served from the shared zeroBuf gets its own zeroed buffer first.
+ */
+static char *slot_mutable(struct __node_cache *node, size_t offset, size_t len)
+{
+    if ( node->readOnly )
+	return NULL;
+    if ( node->zero ) {        /* copy on write, out of the shared zeroBuf */
+	memset(node->cache, 0, node->size);
+	__atomic_store_n(&node->zero, 0, __ATOMIC_RELEASE);
     }
-    return (const char *) ret_val;
+    dirty_mark(node, offset, len);
+    return node->cache;
 }
 
 /* 
  * @param: *cache: pointer to file_cache structure (meta data).
  *    *file: const char * pointer to file name to write to in cache.
- * @ret: const char * pointer to 10Kb in memory cache else NULL if not present.
+ * @ret: char * pointer to the file's data in memory cache else NULL if not present.
  *
  * Notes:
- * This functions returnes a const char pointer to the 10Kb cache to the client if present in cache.
+ * This functions returnes a char pointer to the file's cache to the client if present in cache.
+ * With file_cache_conf.padTo10Kb the buffer is at least 10Kb long, see file_cache_file_data(), but
+ * only the file's own bytes are written back: writes past the end of a shorter file don't reach
+ * the disk.
  * It is the responsibility of the client to synchronize the reads and writes to the file cache.
+ * The lookup itself holds the shard lock so it can't race with a pin or unpin in the same shard.
  * 
  */
 char *file_cache_mutable_file_data(file_cache *cache, const char *file)
+{
+    return file_cache_mutable_file_range(cache, file, 0, (size_t) -1);
+}
+
+/* 
+ * @param: *cache: pointer to file_cache structure (meta data).
+ *    *file: const char * pointer to file name to write to in cache.
+ *    offset, len: the bytes of the file the caller is going to write.
+ * @ret: char * pointer to the start of the file's data in the cache else NULL if not pinned.
+ *
+ * Notes:
+ * Same as file_cache_mutable_file_data() but sets only the bits of the slot's dirtyMap covering
+ * the range, so the flusher writes back just those granules instead of the whole file.
+ * A slot served from the shared zeroBuf gets its own zeroed buffer back first.
+ * 
+ */
+char *file_cache_mutable_file_range(file_cache *cache, const char *file, size_t offset, size_t len)
 {
     char *ret_val = NULL;
+    struct __cache_shard *shard;
+    unsigned int hash;
+    size_t nameLen;
     int i;
     
     if ( !cache || !file )
 	return NULL;
     
-    for ( i = 0; i < cache->currentSize; i++ ) {
+    hash = hash_name(file, &nameLen);
+    shard = shard_of(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+    i = index_find(cache, shard, file, hash, nameLen);
+    if ( i >= 0 && cache->nodeHead[i].refCount > 0 && !cache->nodeHead[i].loading
+	 && !cache->nodeHead[i].loadFailed )
+	ret_val = slot_mutable(&cache->nodeHead[i], offset, len);
+    pthread_mutex_unlock(&shard->lock);
+    return ret_val;
+}
+
+/* 
+ * @param: *cache: pointer to file_cache structure (meta data).
+ *    **files, num_files: as for file_cache_pin_files().
+ *    *handles: set to the handle of each file, FILE_CACHE_NO_HANDLE for those not pinned.
+ * @ret: void
+ *
+ * Notes:
+ * file_cache_pin_files() handing out the slot number of each pin it takes as its handle. A pinned
+ * slot can't be evicted or move, so the handle leads straight to the file until it is unpinned.
+ */
+void file_cache_pin_handles(file_cache *cache, const char **files, int num_files, file_cache_handle *handles)
+{
+    pin_batch(cache, files, num_files, NULL, NULL, handles, 0);
+}
+
+/* 
+ * @param: *cache: pointer to file_cache structure (meta data).
+ *    *handles, num_handles: pins to drop, from file_cache_pin_handles().
+ * @ret: void
+ */
+void file_cache_unpin_handles(file_cache *cache, const file_cache_handle *handles, int num_handles)
+{
+    struct __cache_shard *shard;
+    int i;
 
-	if ( 0 == cache->nodeHead[i].refCount )
+    if ( !cache || !handles )
+	return;
+    for ( i = 0; i < num_handles; i++ ) {
+	if ( handles[i] < 0 || handles[i] >= cache->maxSize )
 	    continue;
-	if ( 0 == strcmp(file, cache->nodeHead[i].name) ) {
-	    cache->nodeHead[i].dirty = 1;
-	    ret_val = cache->nodeHead[i].cache;
-	    break;
-	}
+	shard = shard_of_slot(cache, handles[i]);
+	pthread_mutex_lock(&shard->lock);
+	if ( cache->nodeHead[handles[i]].refCount > 0 )
+	    slot_unpin(cache, shard, handles[i]);
+	pthread_mutex_unlock(&shard->lock);
     }
+}
+
+/* 
+ * @param: *cache: pointer to file_cache structure (meta data).
+ *    handle: handle of a pinned file.
+ * @ret: const char * pointer to the file's data in the cache, NULL for FILE_CACHE_NO_HANDLE.
+ *
+ * Notes:
+ * No lock and no lookup: the pin behind the handle keeps the slot as it is, see index_read().
+ */
+const char *file_cache_handle_data(file_cache *cache, file_cache_handle handle)
+{
+    if ( !cache || handle < 0 || handle >= cache->maxSize )
+	return NULL;
+    return slot_data(cache, &cache->nodeHead[handle]);
+}
+
+/* 
+ * @param: *cache: pointer to file_cache structure (meta data).
+ *    handle: handle of a pinned file.
+ * @ret: bytes of the file's data in the cache, 0 for FILE_CACHE_NO_HANDLE.
+ */
+size_t file_cache_handle_size(file_cache *cache, file_cache_handle handle)
+{
+    if ( !cache || handle < 0 || handle >= cache->maxSize )
+	return 0;
+    return cache->nodeHead[handle].size;
+}
+
+/* 
+ * @param: *cache: pointer to file_cache structure (meta data).
+ *    handle: handle of a pinned file.
+ *    offset, len: the bytes of the file the caller is going to write.
+ * @ret: char * pointer to the start of the file's data in the cache, NULL for FILE_CACHE_NO_HANDLE.
+ *
+ * Notes:
+ * file_cache_mutable_file_range() without the lookup. The shard lock is still taken to mark the
+ * slot dirty.
+ */
+char *file_cache_mutable_handle_range(file_cache *cache, file_cache_handle handle, size_t offset, size_t len)
+{
+    struct __cache_shard *shard;
+    char *ret_val;
+
+    if ( !cache || handle < 0 || handle >= cache->maxSize )
+	return NULL;
+    shard = shard_of_slot(cache, handle);
+    pthread_mutex_lock(&shard->lock);
+    ret_val = slot_mutable(&cache->nodeHead[handle], offset, len);
+    pthread_mutex_unlock(&shard->lock);
     return ret_val;
 }
 
@@ -446,6 +4112,118 @@ void *test_fc(void *payload)
 }
 
 
+/* Reads the pinned file pt->name 'num' times without a lock, counting in 'tid' the reads that
+   don't find its data */
+static void *test_reader(void *payload)
+{
+    struct payload *pt = (struct payload *) payload;
+    const char *data;
+    int i;
+
+    for ( i = 0; i < pt->num; i++ ) {
+	data = pt->c->file_cache_file_data(pt->c, *pt->name);
+	if ( !data || 's' != data[0] )
+	    pt->tid++;
+    }
+    return NULL;
+}
+
+/* Pins pt->name, 'num' files, as one batch and sets 'tid' once the pin returned */
+static void *test_pinner(void *payload)
+{
+    struct payload *pt = (struct payload *) payload;
+
+    pt->c->file_cache_pin_files(pt->c, pt->name, pt->num);
+    __atomic_store_n(&pt->tid, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Returns the mask of the test_pinner() threads of q[0 .. n) whose pin returned */
+static int test_pinned(struct payload *q, int n)
+{
+    int i, mask = 0;
+
+    for ( i = 0; i < n; i++ )
+	mask |= __atomic_load_n(&q[i].tid, __ATOMIC_ACQUIRE) << i;
+    return mask;
+}
+
+/* Waits up to two seconds for the pins of 'cache' to have blocked 'waits' times, see test_pinner().
+   Returns 1 if they have */
+static int test_queued(file_cache *cache, unsigned long long waits)
+{
+    struct file_cache_stats stats;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do
+	file_cache_get_stats(cache, &stats);
+    while ( stats.pinWaits < waits && usec_since(&start) < 2000000 && 0 == usleep(1000) );
+    return stats.pinWaits >= waits;
+}
+
+/* Writes 'size' bytes of 'c' to 'name', for the tests below */
+static void test_file(const char *name, size_t size, int c)
+{
+    char buf[4096];
+    size_t n;
+    int fd;
+
+    memset(buf, c, sizeof(buf));
+    fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if ( fd < 0 )
+	return;
+    for ( ; size > 0; size -= n ) {
+	n = size < sizeof(buf) ? size : sizeof(buf);
+	if ( write(fd, buf, n) != (ssize_t) n )
+	    break;
+    }
+    close(fd);
+}
+
+/* Byte at 'offset' of 'name' on disk, or -1 if it can't be read */
+static int test_byte(const char *name, size_t offset)
+{
+    unsigned char c;
+    int fd, ret = -1;
+
+    fd = open(name, O_RDONLY);
+    if ( fd >= 0 ) {
+	if ( 1 == pread(fd, &c, 1, offset) )
+	    ret = c;
+	close(fd);
+    }
+    return ret;
+}
+
+/* Appends a write log record of 'data' at 'offset' of 'name' to the log 'fd', with a wrong check
+   unless 'good' */
+static void test_log_rec(int fd, const char *name, size_t offset, const char *data, int good)
+{
+    struct __log_rec rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = FC_LOG_MAGIC;
+    rec.nameLen = strlen(name);
+    rec.offset = offset;
+    rec.len = strlen(data);
+    rec.check = crc32c_carry(crc32c_carry(crc32c(&rec, sizeof(rec)), name, rec.nameLen), data, rec.len);
+    rec.check ^= !good;
+    if ( write(fd, &rec, sizeof(rec)) != (ssize_t) sizeof(rec) || write(fd, name, rec.nameLen) < 0
+	 || write(fd, data, rec.len) < 0 )
+	dbug_p("can't write the test log\n");
+}
+
+/* List the resident slot of 'name' is on, FC_LIST_*, or -1 if the file isn't cached */
+static int test_list(file_cache *cache, const char *name)
+{
+    size_t len;
+    unsigned int hash = hash_name(name, &len);
+    int slot = index_find(cache, shard_of(cache, hash), name, hash, len);
+
+    return slot < 0 ? -1 : cache->nodeHead[slot].onList;
+}
+
 /*
  * Some unit test case for the file cache implementation.
 */
@@ -458,8 +4236,27 @@ void test_case()
     const char *rPt;		/* Read pointer returned from */
     char *wPt;                  /* Write pointer returned from */
     const char *fileList;
-    int total = 7, passed = 0, maxcount = 0, currentcount = 0, i, flag = 0;
+    int total = 36, passed = 0, maxcount = 0, currentcount = 0, i, k, flag = 0;
     const char *fn [4];
+    const char *big [3] = { "tc_big.0", "tc_big.1", "tc_small" };
+    const char *some [2];
+    const char *evict [4] = { "tc_evict.0", "tc_evict.1", "tc_evict.2", "tc_evict.3" };
+    const char *frag [7] = { "tc_frag.0", "tc_frag.1", "tc_frag.2", "tc_frag.3", "tc_frag.4", "tc_frag.5",
+			     "tc_frag.6" };
+    const int fragSize [7] = { 20000, 30000, 10000, 20000, 25000, 30000, 15000 };
+    const int fragOrder [10] = { 0, 1, 1, 2, 3, 1, 4, -1, 5, 6 };
+    const char *adm [10] = { "tc_adm.0", "tc_adm.1", "tc_adm.2", "tc_adm.3", "tc_adm.4", "tc_adm.5",
+			     "tc_adm.6", "tc_adm.7", "tc_adm.8", "tc_adm.9" };
+    const int admNum [4] = { 3, 1, 1, 1 };
+    struct payload reader, queue [4];
+    pthread_t thread, queueThread [4];
+    file_cache_handle handles [2];
+    unsigned long long sum [2];
+    char pinned [4];
+    struct timespec start;
+    struct stat st;
+    struct file_cache_conf conf;
+    struct file_cache_stats stats;
 
     fn[0] = "bt.c";
     fn[1] = "ad.out";
@@ -469,17 +4266,19 @@ void test_case()
 
     printf("Executing Some Basic Test Case.\n");
 
-    /* Test to check if only a singleton instance is returned 
-       from constructor even on multiple invocation */
+    /* Test to check that every invocation of the
+       constructor returns an independent instance */
 
     pt1 = file_cache_construct(4);
     pt2 = file_cache_construct(9);
-    if ( pt1 == pt2 ) {
+    if ( pt1 && pt2 && pt1 != pt2 && 4 == pt1->maxSize && 9 == pt2->maxSize ) {
 	++passed;
-	printf("Singleton test passed.\n");
+	printf("Independent instance test passed.\n");
     }
     else
-	printf("Singleton test failed.\n");
+	printf("Independent instance test failed.\n");
+    if ( pt2 )
+	pt2->file_cache_destroy(pt2);
     
 
     /* Test to check if Pining of File Cache working */
@@ -555,6 +4354,730 @@ void test_case()
     if ( !flag )
 	++passed;
 
+    /* Unpinned files stay resident, so re-pinning one is a hit on the same buffer */
+    rPt = pt1->file_cache_file_data(pt1, fn[0]);
+    pt1->file_cache_unpin_files(pt1, &fn[0], 1);
+    pt1->file_cache_pin_files(pt1, &fn[0], 1);
+    if ( rPt && rPt == pt1->file_cache_file_data(pt1, fn[0]) ) {
+	++passed;
+	printf("Repin of resident unpinned file hit PASS.\n");
+    }
+    else
+	printf("Repin of resident unpinned file hit FAIL.\n");
+
+    /* Two files of 2.2Mb fit a one shard cache of 4.7Mb together, though no single buddy block
+       is left for the second. A try pin would fail if the batch had to wait for the room */
+    test_file(big[0], 2200 * 1024, 'a');
+    test_file(big[1], 2200 * 1024, 'b');
+    pt2 = file_cache_construct(300);
+    if ( 1 == pt2->numShards && 2 == pt2->file_cache_try_pin_files(pt2, big, 2, NULL)
+	 && (rPt = pt2->file_cache_file_data(pt2, big[1])) && 'b' == rPt[0] && 'b' == rPt[2200 * 1024 - 1] ) {
+	++passed;
+	printf("Large files sharing a fragmented shard PASS.\n");
+    }
+    else
+	printf("Large files sharing a fragmented shard FAIL.\n");
+    pt2->file_cache_unpin_files(pt2, big, 2);
+    pt2->file_cache_destroy(pt2);
+
+    /* By default a small file's buffer is sized to it, in 512 byte units */
+    test_file(big[2], 100, 's');
+    pt2 = file_cache_construct(4);
+    pt2->file_cache_pin_files(pt2, &big[2], 1);
+    if ( 512 == pt2->shards[0].usedBytes && 's' == pt2->file_cache_file_data(pt2, big[2])[99] ) {
+	++passed;
+	printf("Small file takes a 512 byte buffer PASS.\n");
+    }
+    else
+	printf("Small file takes a 512 byte buffer FAIL.\n");
+    pt2->file_cache_unpin_files(pt2, &big[2], 1);
+    pt2->file_cache_destroy(pt2);
+
+    /* With padTo10Kb a file shorter than 10Kb gets a buffer of 10Kb, zeros past the end of the
+       file, and writing all of it leaves the file on disk at its own size */
+    file_cache_conf_init(&conf, 4);
+    conf.padTo10Kb = 1;
+    pt2 = file_cache_construct_with(&conf);
+    pt2->file_cache_pin_files(pt2, &big[2], 1);
+    wPt = pt2->file_cache_mutable_file_data(pt2, big[2]);
+    for ( i = 100; wPt && i < 10240 && 0 == wPt[i]; i++ )
+	;
+    if ( wPt && 10240 == i ) {
+	memset(wPt, 'S', 10240);
+	pt2->file_cache_unpin_files(pt2, &big[2], 1);
+	pt2->file_cache_destroy(pt2);
+	pt2 = NULL;
+	if ( 0 == stat(big[2], &st) && 100 == st.st_size ) {
+	    ++passed;
+	    printf("Small file keeps a 10Kb buffer PASS.\n");
+	}
+	else
+	    printf("Small file keeps a 10Kb buffer FAIL.\n");
+    }
+    else
+	printf("Small file keeps a 10Kb buffer FAIL.\n");
+    if ( pt2 )
+	pt2->file_cache_destroy(pt2);
+
+    /* A try pin on a cache whose every slot is pinned gives up at once, pinning nothing, not
+       even the file of the batch that is pinned already */
+    pt2 = file_cache_construct(4);
+    pt2->file_cache_pin_files(pt2, fn, 4);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(pinned, 1, sizeof(pinned));
+    some[0] = fn[0];
+    some[1] = big[2];
+    if ( -1 == pt2->file_cache_try_pin_files(pt2, some, 2, pinned) && usec_since(&start) < 100000
+	 && !pinned[0] && !pinned[1] ) {
+	pt2->file_cache_unpin_files(pt2, fn, 1);
+	if ( !pt2->file_cache_file_data(pt2, fn[0]) ) {
+	    ++passed;
+	    printf("Try pin on a full cache PASS.\n");
+	}
+	else
+	    printf("Try pin on a full cache FAIL.\n");
+	pt2->file_cache_pin_files(pt2, fn, 1);
+    }
+    else
+	printf("Try pin on a full cache FAIL.\n");
+
+    /* A timed pin waits out its timeout, no less and not much more */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ( -1 == pt2->file_cache_timed_pin_files(pt2, &big[2], 1, 200, pinned)
+	 && usec_since(&start) >= 200000 && usec_since(&start) < 2000000 && !pinned[0] ) {
+	++passed;
+	printf("Timed pin on a full cache PASS.\n");
+    }
+    else
+	printf("Timed pin on a full cache FAIL.\n");
+
+    /* Once there is room the try pin takes what it can: a missing file is created but not pinned,
+       and pinned[] tells the two apart */
+    pt2->file_cache_unpin_files(pt2, fn, 4);
+    unlink("tc_missing");
+    some[1] = "tc_missing";
+    if ( 1 == pt2->file_cache_try_pin_files(pt2, some, 2, pinned) && pinned[0] && !pinned[1]
+	 && pt2->file_cache_file_data(pt2, some[0]) && !pt2->file_cache_file_data(pt2, some[1])
+	 && 0 == access(some[1], F_OK) ) {
+	++passed;
+	printf("Try pin of a partial batch PASS.\n");
+    }
+    else
+	printf("Try pin of a partial batch FAIL.\n");
+    pt2->file_cache_unpin_files(pt2, some, 1);
+    pt2->file_cache_destroy(pt2);
+    unlink(some[1]);
+
+    /* Under SLRU a prefetched file stays on probation through its first pin, and only the
+       second pin makes it hot */
+    file_cache_conf_init(&conf, 4);
+    conf.policy = FILE_CACHE_POLICY_SLRU;
+    conf.ioThreads = 0;
+    pt2 = file_cache_construct_with(&conf);
+    pt2->file_cache_prefetch_files(pt2, &fn[2], 1);
+    i = test_list(pt2, fn[2]);
+    pt2->file_cache_pin_files(pt2, &fn[2], 1);
+    pt2->file_cache_unpin_files(pt2, &fn[2], 1);
+    flag = test_list(pt2, fn[2]);
+    pt2->file_cache_pin_files(pt2, &fn[2], 1);
+    pt2->file_cache_unpin_files(pt2, &fn[2], 1);
+    if ( FC_LIST_LRU == i && FC_LIST_LRU == flag && FC_LIST_PROT == test_list(pt2, fn[2]) ) {
+	++passed;
+	printf("Prefetched file not hot on its first pin PASS.\n");
+    }
+    else
+	printf("Prefetched file not hot on its first pin FAIL.\n");
+    pt2->file_cache_destroy(pt2);
+
+    /* A sync writes back a pinned file but leaves it dirty: what is written through the same
+       mutable pointer afterwards still reaches the disk */
+    test_file(big[2], 100, 's');
+    pt2 = file_cache_construct(4);
+    pt2->file_cache_pin_files(pt2, &big[2], 1);
+    wPt = pt2->file_cache_mutable_file_data(pt2, big[2]);
+    if ( wPt ) {
+	wPt[0] = 'X';
+	flag = pt2->file_cache_sync(pt2);
+	wPt[1] = 'Y';
+    }
+    pt2->file_cache_unpin_files(pt2, &big[2], 1);
+    pt2->file_cache_destroy(pt2);
+    memset(pinned, 0, sizeof(pinned));
+    i = open(big[2], O_RDONLY);
+    if ( i >= 0 ) {
+	if ( read(i, pinned, 2) != 2 )
+	    pinned[0] = 0;
+	close(i);
+    }
+    if ( wPt && 0 == flag && 'X' == pinned[0] && 'Y' == pinned[1] ) {
+	++passed;
+	printf("Write after sync of a pinned file PASS.\n");
+    }
+    else
+	printf("Write after sync of a pinned file FAIL.\n");
+
+    /* A write log left by a crash before its checkpoint is replayed by the next constructor, and
+       emptied */
+    test_file(big[2], 100, 's');
+    i = open("tc_log", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    test_log_rec(i, big[2], 0, "LOG", 1);
+    test_log_rec(i, big[2], 10, "TAIL", 0);     /* Bad check: ignored, and so is what follows */
+    test_log_rec(i, big[2], 20, "LOST", 1);
+    close(i);
+    file_cache_conf_init(&conf, 4);
+    conf.logPath = "tc_log";
+    pt2 = file_cache_construct_with(&conf);
+    memset(pinned, 0, sizeof(pinned));
+    rPt = NULL;
+    if ( pt2 ) {
+	pt2->file_cache_pin_files(pt2, &big[2], 1);
+	rPt = pt2->file_cache_file_data(pt2, big[2]);
+    }
+    if ( rPt && !memcmp(rPt, "LOGs", 4) && 0 == stat("tc_log", &st) && 0 == st.st_size ) {
+	++passed;
+	printf("Write log replayed at construction PASS.\n");
+    }
+    else
+	printf("Write log replayed at construction FAIL.\n");
+
+    /* A bad check or a torn record ends the log: nothing past it is replayed */
+    if ( rPt && 's' == rPt[10] && 's' == rPt[20] ) {
+	pt2->file_cache_unpin_files(pt2, &big[2], 1);
+	pt2->file_cache_destroy(pt2);
+	i = open("tc_log", O_WRONLY | O_TRUNC);
+	test_log_rec(i, big[2], 30, "GOOD", 1);
+	test_log_rec(i, big[2], 40, "TORN", 1);
+	flag = ftruncate(i, lseek(i, 0, SEEK_CUR) - 2);
+	close(i);
+	pt2 = file_cache_construct_with(&conf);
+	pt2->file_cache_pin_files(pt2, &big[2], 1);
+	rPt = pt2->file_cache_file_data(pt2, big[2]);
+    }
+    else
+	rPt = NULL;
+    if ( rPt && !flag && !memcmp(rPt + 30, "GOOD", 4) && 's' == rPt[40] ) {
+	++passed;
+	printf("Write log replay stops at a bad tail PASS.\n");
+    }
+    else
+	printf("Write log replay stops at a bad tail FAIL.\n");
+
+    /* A sync appends the data to the log, the checkpoint of the last flush empties it */
+    wPt = pt2 ? pt2->file_cache_mutable_file_data(pt2, big[2]) : NULL;
+    flag = -1;
+    if ( wPt ) {
+	wPt[50] = 'C';
+	if ( 0 == pt2->file_cache_sync(pt2) && 0 == stat("tc_log", &st) && st.st_size > 0 )
+	    flag = 0;
+    }
+    if ( pt2 ) {
+	pt2->file_cache_unpin_files(pt2, &big[2], 1);
+	pt2->file_cache_destroy(pt2);
+    }
+    i = open(big[2], O_RDONLY);
+    if ( i >= 0 ) {
+	if ( pread(i, pinned, 1, 50) != 1 )
+	    pinned[0] = 0;
+	close(i);
+    }
+    if ( 0 == flag && 'C' == pinned[0] && 0 == stat("tc_log", &st) && 0 == st.st_size ) {
+	++passed;
+	printf("Write log checkpoint truncates the log PASS.\n");
+    }
+    else
+	printf("Write log checkpoint truncates the log FAIL.\n");
+    unlink("tc_log");
+
+    /* The flusher writes a dirty file back in the background once it is unpinned, with no sync
+       or destroy to push it */
+    test_file(big[2], 100, 's');
+    file_cache_conf_init(&conf, 4);
+    conf.flushIntervalMs = 20;
+    pt2 = file_cache_construct_with(&conf);
+    pt2->file_cache_pin_files(pt2, &big[2], 1);
+    wPt = pt2->file_cache_mutable_file_data(pt2, big[2]);
+    if ( wPt )
+	wPt[0] = 'F';
+    pt2->file_cache_unpin_files(pt2, &big[2], 1);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while ( 'F' != test_byte(big[2], 0) && usec_since(&start) < 2000000 )
+	usleep(1000);
+    if ( wPt && 'F' == test_byte(big[2], 0) ) {
+	++passed;
+	printf("Background flusher writes back an unpinned file PASS.\n");
+    }
+    else
+	printf("Background flusher writes back an unpinned file FAIL.\n");
+    pt2->file_cache_destroy(pt2);
+
+    /* FILE_CACHE_MODE_MMAP hands out the file's own mapping, and writes through it reach the file */
+    test_file(big[2], 8192, 'm');
+    file_cache_conf_init(&conf, 4);
+    conf.mode = FILE_CACHE_MODE_MMAP;
+    pt2 = file_cache_construct_with(&conf);
+    pt2->file_cache_pin_files(pt2, &big[2], 1);
+    rPt = pt2->file_cache_file_data(pt2, big[2]);
+    wPt = pt2->file_cache_mutable_file_data(pt2, big[2]);
+    if ( wPt )
+	wPt[100] = 'W';
+    flag = rPt && wPt == rPt && 'm' == rPt[8191] && 8192 == pt2->file_cache_file_size(pt2, big[2]);
+    pt2->file_cache_unpin_files(pt2, &big[2], 1);
+    pt2->file_cache_destroy(pt2);
+    if ( flag && 'W' == test_byte(big[2], 100) && 'm' == test_byte(big[2], 101) ) {
+	++passed;
+	printf("Mmap mode reads and writes the file's mapping PASS.\n");
+    }
+    else
+	printf("Mmap mode reads and writes the file's mapping FAIL.\n");
+
+    /* Mmap mode maps a read-only file read-only, and serves an empty file, which has nothing to
+       map, from the zero buffer */
+    test_file(big[2], 8192, 'm');
+    test_file("tc_empty", 0, 0);
+    chmod(big[2], 0444);
+    some[0] = big[2];
+    some[1] = "tc_empty";
+    pt2 = file_cache_construct_with(&conf);
+    flag = 2 == pt2->file_cache_try_pin_files(pt2, some, 2, NULL);
+    rPt = pt2->file_cache_file_data(pt2, some[0]);
+    wPt = pt2->file_cache_mutable_file_data(pt2, some[0]);
+    flag = flag && rPt && 'm' == rPt[8191] && (NULL == wPt) == (0 != access(some[0], W_OK));
+    rPt = pt2->file_cache_file_data(pt2, some[1]);
+    flag = flag && rPt && 0 == rPt[0] && 0 == pt2->file_cache_file_size(pt2, some[1]);
+    pt2->file_cache_unpin_files(pt2, some, 2);
+    pt2->file_cache_destroy(pt2);
+    chmod(big[2], 0644);
+    if ( flag ) {
+	++passed;
+	printf("Mmap mode pins read-only and empty files PASS.\n");
+    }
+    else
+	printf("Mmap mode pins read-only and empty files FAIL.\n");
+    unlink(some[1]);
+
+    /* Writeback rewrites only the granules marked by file_cache_mutable_file_range(): a change
+       made to the file on disk elsewhere meanwhile is left alone */
+    test_file(big[2], 8192, 'r');
+    pt2 = file_cache_construct(4);
+    pt2->file_cache_pin_files(pt2, &big[2], 1);
+    wPt = pt2->file_cache_mutable_file_range(pt2, big[2], 4096, 1);
+    if ( wPt )
+	wPt[4096] = 'R';
+    i = open(big[2], O_WRONLY);
+    flag = i >= 0 && 1 == pwrite(i, "Z", 1, 0);
+    if ( i >= 0 )
+	close(i);
+    pt2->file_cache_unpin_files(pt2, &big[2], 1);
+    pt2->file_cache_destroy(pt2);
+    if ( wPt && flag && 'R' == test_byte(big[2], 4096) && 'Z' == test_byte(big[2], 0)
+	 && 'r' == test_byte(big[2], 4096 + 512) ) {
+	++passed;
+	printf("Writeback of a dirty range only PASS.\n");
+    }
+    else
+	printf("Writeback of a dirty range only FAIL.\n");
+
+    /* A prefetch reads the file in the background and leaves it unpinned, so the pin after it is a
+       hit. The read ahead itself is neither a hit nor a miss */
+    pt2 = file_cache_construct(4);
+    pt2->file_cache_prefetch_files(pt2, &fn[2], 1);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do
+	pt2->file_cache_get_stats(pt2, &stats);
+    while ( (0 == stats.prefetches || __atomic_load_n(&pt2->currentSize, __ATOMIC_RELAXED))
+	    && usec_since(&start) < 2000000 && 0 == usleep(1000) );
+    flag = 1 == stats.prefetches && 0 == stats.misses && 0 == stats.hits
+	&& !pt2->file_cache_file_data(pt2, fn[2]);
+    pt2->file_cache_pin_files(pt2, &fn[2], 1);
+    pt2->file_cache_get_stats(pt2, &stats);
+    if ( flag && 0 == stats.misses && 1 == stats.hits && pt2->file_cache_file_data(pt2, fn[2]) ) {
+	++passed;
+	printf("Prefetched file pinned as a hit PASS.\n");
+    }
+    else
+	printf("Prefetched file pinned as a hit FAIL.\n");
+    pt2->file_cache_unpin_files(pt2, &fn[2], 1);
+    pt2->file_cache_destroy(pt2);
+
+    /* A prefetch of a file that doesn't exist skips it, where a pin would create it */
+    unlink("tc_stat");
+    file_cache_conf_init(&conf, 4);
+    conf.ioThreads = 0;                  /* Read ahead before file_cache_prefetch_files() returns */
+    pt2 = file_cache_construct_with(&conf);
+    some[0] = "tc_stat";
+    pt2->file_cache_prefetch_files(pt2, some, 1);
+    pt2->file_cache_get_stats(pt2, &stats);
+    if ( 0 != access(some[0], F_OK) && 0 == stats.prefetches && 0 == pt2->currentSize ) {
+	++passed;
+	printf("Prefetch of a missing file creates nothing PASS.\n");
+    }
+    else
+	printf("Prefetch of a missing file creates nothing FAIL.\n");
+    pt2->file_cache_destroy(pt2);
+
+    /* A file that is all holes, and one of written zeros, are both served from the shared zeroBuf.
+       The first write to one copies it into its own buffer, leaves zeroBuf and the other file zero,
+       and lands on disk at its offset with the rest of the file still zero */
+    unlink("tc_hole");
+    test_file("tc_stat", 4096, 0);
+    i = open("tc_hole", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    flag = i >= 0 && 0 == ftruncate(i, 20000);
+    if ( i >= 0 )
+	close(i);
+    some[0] = "tc_hole";
+    some[1] = "tc_stat";
+    pt2 = file_cache_construct(4);
+    pt2->file_cache_pin_files(pt2, some, 2);
+    rPt = pt2->file_cache_file_data(pt2, some[0]);
+    flag = flag && pt2->zeroBuf && rPt == pt2->zeroBuf
+	&& pt2->file_cache_file_data(pt2, some[1]) == pt2->zeroBuf
+	&& 20000 == pt2->file_cache_file_size(pt2, some[0]);
+    wPt = pt2->file_cache_mutable_file_range(pt2, some[0], 100, 1);
+    if ( wPt )
+	wPt[100] = 'H';
+    rPt = pt2->file_cache_file_data(pt2, some[0]);
+    flag = flag && wPt && wPt != pt2->zeroBuf && rPt == wPt && 'H' == rPt[100] && 0 == rPt[0]
+	&& 0 == rPt[19999] && 0 == pt2->zeroBuf[100]
+	&& pt2->file_cache_file_data(pt2, some[1]) == pt2->zeroBuf;
+    pt2->file_cache_unpin_files(pt2, some, 2);
+    pt2->file_cache_destroy(pt2);
+    if ( flag && 'H' == test_byte(some[0], 100) && 0 == test_byte(some[0], 0)
+	 && 0 == test_byte(some[0], 19999) && -1 == test_byte(some[0], 20000) && 0 == test_byte(some[1], 100) ) {
+	++passed;
+	printf("Zero files served from zeroBuf, copied on write PASS.\n");
+    }
+    else
+	printf("Zero files served from zeroBuf, copied on write FAIL.\n");
+    unlink(some[0]);
+    unlink(some[1]);
+
+    /* A file fetched for writing and left as it was matches its checksum, so the flush skips the
+       write: a change made on disk behind the cache's back meanwhile survives the sync */
+    test_file("tc_stat", 4096, 'u');
+    some[0] = "tc_stat";
+    pt2 = file_cache_construct(4);
+    pt2->file_cache_pin_files(pt2, some, 1);
+    wPt = pt2->file_cache_mutable_file_data(pt2, some[0]);
+    i = open(some[0], O_WRONLY);
+    flag = wPt && 'u' == wPt[0] && i >= 0 && 1 == pwrite(i, "X", 1, 0);
+    if ( i >= 0 )
+	close(i);
+    pt2->file_cache_unpin_files(pt2, some, 1);
+    flag = flag && 0 == pt2->file_cache_sync(pt2);
+    pt2->file_cache_get_stats(pt2, &stats);
+    pt2->file_cache_destroy(pt2);
+    if ( flag && 1 == stats.unchangedFlushes && 0 == stats.writebacks && 0 == stats.bytesWritten
+	 && 'X' == test_byte(some[0], 0) && 'u' == test_byte(some[0], 1) ) {
+	++passed;
+	printf("Unchanged mutable file not written back PASS.\n");
+    }
+    else
+	printf("Unchanged mutable file not written back FAIL.\n");
+    unlink(some[0]);
+
+    /* The counters add up: two misses and a hit, the bytes read in, one writeback of one granule,
+       and a latency sample per miss and per writeback */
+    test_file(big[2], 100, 's');
+    test_file("tc_stat", 4096, 't');
+    some[0] = big[2];
+    some[1] = "tc_stat";
+    pt2 = file_cache_construct(4);
+    pt2->file_cache_pin_files(pt2, some, 2);
+    pt2->file_cache_pin_files(pt2, &some[1], 1);
+    wPt = pt2->file_cache_mutable_file_range(pt2, some[1], 0, 1);
+    if ( wPt )
+	wPt[0] = 'T';
+    pt2->file_cache_unpin_files(pt2, some, 2);
+    pt2->file_cache_unpin_files(pt2, &some[1], 1);
+    flag = pt2->file_cache_sync(pt2);
+    pt2->file_cache_get_stats(pt2, &stats);
+    pt2->file_cache_destroy(pt2);
+    sum[0] = sum[1] = 0;
+    for ( i = 0; i < FC_HIST_BUCKETS; i++ ) {
+	sum[0] += stats.missLatency[i];
+	sum[1] += stats.flushLatency[i];
+    }
+    if ( 0 == flag && 2 == stats.misses && 1 == stats.hits && 4196 == stats.bytesRead
+	 && 1 == stats.writebacks && 512 == stats.bytesWritten && 2 == sum[0] && 1 == sum[1] ) {
+	++passed;
+	printf("Stats count pins, bytes and latencies PASS.\n");
+    }
+    else
+	printf("Stats count pins, bytes and latencies FAIL.\n");
+    unlink(some[1]);
+
+    /* Lock-free reads of a pinned file keep finding it while other slots of its shard are
+       evicted and reused under other names */
+    test_file(big[2], 100, 's');
+    for ( i = 0; i < 4; i++ )
+	test_file(evict[i], 100, 'e');
+    pt2 = file_cache_construct(4);
+    pt2->file_cache_pin_files(pt2, &big[2], 1);
+    reader.c = pt2;
+    reader.name = &big[2];
+    reader.num = 200000;
+    reader.tid = 0;
+    flag = 0;
+    if ( pthread_create(&thread, NULL, test_reader, &reader) )
+	flag = 1;
+    else {
+	for ( i = 0; i < 2000; i++ ) {
+	    pt2->file_cache_pin_files(pt2, &evict[i % 4], 1);
+	    if ( !pt2->file_cache_file_data(pt2, evict[i % 4]) )
+		flag = 1;
+	    pt2->file_cache_unpin_files(pt2, &evict[i % 4], 1);
+	}
+	pthread_join(thread, NULL);
+    }
+    if ( !flag && 0 == reader.tid ) {
+	++passed;
+	printf("Lock-free read during evictions PASS.\n");
+    }
+    else
+	printf("Lock-free read during evictions FAIL.\n");
+    pt2->file_cache_unpin_files(pt2, &big[2], 1);
+    pt2->file_cache_destroy(pt2);
+    for ( i = 0; i < 4; i++ )
+	unlink(evict[i]);
+
+    /* A handle reaches the same data as the name, and unpinning it gives the pin back. A file that
+       had to be created gets no handle */
+    test_file(big[2], 100, 's');
+    unlink("tc_missing");
+    some[0] = big[2];
+    some[1] = "tc_missing";
+    pt2 = file_cache_construct(4);
+    pt2->file_cache_pin_handles(pt2, some, 2, handles);
+    flag = FILE_CACHE_NO_HANDLE != handles[0] && FILE_CACHE_NO_HANDLE == handles[1]
+	&& pt2->file_cache_handle_data(pt2, handles[0]) == pt2->file_cache_file_data(pt2, some[0])
+	&& 100 == pt2->file_cache_handle_size(pt2, handles[0]);
+    wPt = flag ? pt2->file_cache_mutable_handle_range(pt2, handles[0], 1, 1) : NULL;
+    if ( wPt )
+	wPt[1] = 'H';
+    pt2->file_cache_unpin_handles(pt2, handles, 2);
+    flag = flag && wPt && !pt2->file_cache_file_data(pt2, some[0]) && 0 == pt2->currentSize;
+    pt2->file_cache_destroy(pt2);
+    if ( flag && 'H' == test_byte(some[0], 1) ) {
+	++passed;
+	printf("Pin, write and unpin by handle PASS.\n");
+    }
+    else
+	printf("Pin, write and unpin by handle FAIL.\n");
+    unlink(some[1]);
+
+    /* Destroy lists the resident files in the manifest, and the next cache reads them back in the
+       background before they are pinned. A file deleted in between is skipped, not created. A
+       cache without io workers writes the manifest but doesn't read it back */
+    test_file(big[2], 100, 's');
+    test_file("tc_stat", 100, 't');
+    some[0] = big[2];
+    some[1] = "tc_stat";
+    unlink("tc_manifest");
+    file_cache_conf_init(&conf, 4);
+    conf.manifestPath = "tc_manifest";
+    conf.ioThreads = 0;
+    pt2 = file_cache_construct_with(&conf);
+    pt2->file_cache_pin_files(pt2, some, 2);
+    pt2->file_cache_unpin_files(pt2, some, 2);
+    pt2->file_cache_destroy(pt2);
+    unlink(some[1]);
+    conf.ioThreads = 2;
+    pt2 = file_cache_construct_with(&conf);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do
+	pt2->file_cache_get_stats(pt2, &stats);
+    while ( (0 == stats.prefetches || __atomic_load_n(&pt2->currentSize, __ATOMIC_RELAXED))
+	    && usec_since(&start) < 2000000 && 0 == usleep(1000) );
+    flag = 1 == stats.prefetches && 0 != access(some[1], F_OK);
+    pt2->file_cache_pin_files(pt2, some, 1);
+    pt2->file_cache_get_stats(pt2, &stats);
+    flag = flag && 0 == stats.misses && 1 == stats.hits;
+    pt2->file_cache_unpin_files(pt2, some, 1);
+    pt2->file_cache_destroy(pt2);
+    conf.ioThreads = 0;
+    pt2 = file_cache_construct_with(&conf);
+    pt2->file_cache_get_stats(pt2, &stats);
+    if ( flag && 0 == stats.prefetches && 0 == pt2->currentSize ) {
+	++passed;
+	printf("Warm restart from the manifest PASS.\n");
+    }
+    else
+	printf("Warm restart from the manifest FAIL.\n");
+    pt2->file_cache_destroy(pt2);
+    unlink("tc_manifest");
+
+    /* Three files of 118 units fit a shard of 384 that is empty, however the files evicted for
+       them had split it: a batch whose buffers end up cutting the room it made in pieces places
+       them again on the emptied arena, and doesn't drop the last one */
+    for ( i = 0; i < 4; i++ )
+	test_file(evict[i], 20000, 'e');
+    test_file("tc_stat", 20000, 'e');
+    for ( i = 0; i < 3; i++ )
+	test_file(big[i], 60000, 'a' + i);
+    file_cache_conf_init(&conf, 24);
+    conf.maxBytes = 384 << FC_BLOCK_SHIFT;
+    conf.numShards = 1;
+    pt2 = file_cache_construct_with(&conf);
+    for ( i = 0; i < 5; i++ ) {                 /* Five 40 unit files spread over the arena */
+	some[0] = i < 4 ? evict[i] : "tc_stat";
+	pt2->file_cache_pin_files(pt2, some, 1);
+	pt2->file_cache_unpin_files(pt2, some, 1);
+    }
+    pt2->file_cache_pin_files(pt2, big, 3);
+    for ( i = 0; i < 3 && pt2->file_cache_file_data(pt2, big[i]); i++ )
+	;
+    if ( 3 == i ) {
+	++passed;
+	printf("Batch placed again after its evictions PASS.\n");
+	pt2->file_cache_unpin_files(pt2, big, 3);
+    }
+    else
+	printf("Batch placed again after its evictions FAIL.\n");
+    pt2->file_cache_destroy(pt2);
+    for ( i = 0; i < 4; i++ )
+	unlink(evict[i]);
+    unlink("tc_stat");
+
+    /* A cached, unpinned file of the batch that splits the room the misses need is evicted and
+       read again along with them, rather than a miss being dropped */
+    for ( i = 0; i < 7; i++ )
+	test_file(frag[i], fragSize[i], 'f');
+    pt2 = file_cache_construct_with(&conf);
+    for ( i = 0; i < 10; i++ ) {
+	some[0] = fragOrder[i] < 0 ? big[0] : frag[fragOrder[i]];
+	pt2->file_cache_pin_files(pt2, some, 1);
+	pt2->file_cache_unpin_files(pt2, some, 1);
+    }
+    pt2->file_cache_pin_files(pt2, big, 3);
+    for ( i = 0; i < 3 && pt2->file_cache_file_data(pt2, big[i]); i++ )
+	;
+    if ( 3 == i && 'a' == pt2->file_cache_file_data(pt2, big[0])[59999] ) {
+	++passed;
+	printf("Batch evicts its own cached file for room PASS.\n");
+	pt2->file_cache_unpin_files(pt2, big, 3);
+    }
+    else
+	printf("Batch evicts its own cached file for room FAIL.\n");
+    pt2->file_cache_destroy(pt2);
+    for ( i = 0; i < 7; i++ )
+	unlink(frag[i]);
+
+    /* Blocked pins are admitted in arrival order, a batch only once all of its slots are there:
+       with four pinned files in one shard, a batch of three queues first, then three single pins.
+       One slot freed wakes nobody, the head needs three. Two more freed by one unpin wake the
+       batch alone, the next slot only the first single pin, and the next two, in one unpin, both
+       of the others */
+    for ( i = 0; i < 10; i++ )
+	test_file(adm[i], 100, 'q');
+    file_cache_conf_init(&conf, 4);
+    conf.numShards = 1;
+    pt2 = file_cache_construct_with(&conf);
+    pt2->file_cache_pin_files(pt2, adm, 4);
+    flag = 4 == pt2->currentSize;
+    for ( i = 0; i < 4; i++ )
+	queue[i].c = NULL;
+    for ( i = 0; flag && i < 4; i++ ) {
+	queue[i].c = pt2;
+	queue[i].name = &adm[i ? 6 + i : 4];
+	queue[i].num = admNum[i];
+	queue[i].tid = 0;
+	if ( pthread_create(&queueThread[i], NULL, test_pinner, &queue[i]) ) {
+	    queue[i].c = NULL;
+	    flag = 0;
+	}
+	else
+	    flag = test_queued(pt2, i + 1);
+    }
+    pt2->file_cache_unpin_files(pt2, adm, 1);
+    usleep(50000);
+    flag = flag && 0 == test_pinned(queue, 4);
+    pt2->file_cache_unpin_files(pt2, &adm[1], 2);
+    for ( i = 0; i < 200 && !test_pinned(queue, 1); i++ )
+	usleep(10000);
+    usleep(50000);
+    flag = flag && 1 == test_pinned(queue, 4);
+    pt2->file_cache_unpin_files(pt2, &adm[3], 1);
+    for ( i = 0; i < 200 && 3 != test_pinned(queue, 2); i++ )
+	usleep(10000);
+    usleep(50000);
+    flag = flag && 3 == test_pinned(queue, 4);
+    pt2->file_cache_unpin_files(pt2, &adm[4], 2);
+    for ( i = 0; i < 200 && 15 != test_pinned(queue, 4); i++ )
+	usleep(10000);
+    flag = flag && 15 == test_pinned(queue, 4) && pt2->file_cache_file_data(pt2, adm[9]);
+    if ( flag ) {
+	++passed;
+	printf("Blocked pins admitted in order, whole batches PASS.\n");
+    }
+    else
+	printf("Blocked pins admitted in order, whole batches FAIL.\n");
+    for ( i = 0; i < 4 && queue[i].c; i++ ) {    /* Unpin until every queued pin got through */
+	while ( !test_pinned(&queue[i], 1) && 0 == usleep(1000) )
+	    pt2->file_cache_unpin_files(pt2, adm, 10);
+	pthread_join(queueThread[i], NULL);
+    }
+    pt2->file_cache_unpin_files(pt2, adm, 10);
+    pt2->file_cache_destroy(pt2);
+    for ( i = 0; i < 10; i++ )
+	unlink(adm[i]);
+
+    /* A batch of misses is read in by the io workers, through io_uring where there is one, through
+       the worker pool without it, and mapped by the pool in FILE_CACHE_MODE_MMAP: each file lands
+       whole, each a miss with a latency sample */
+    for ( i = 0; i < 7; i++ )
+	test_file(frag[i], fragSize[i], 'A' + i);
+    for ( flag = 1, k = 0; k < 3; k++ ) {
+	file_cache_conf_init(&conf, 16);
+	conf.ioThreads = 4;
+	conf.ioUring = 0 == k;
+	conf.mode = 2 == k ? FILE_CACHE_MODE_MMAP : FILE_CACHE_MODE_COPY;
+	pt2 = file_cache_construct_with(&conf);
+	pt2->file_cache_pin_files(pt2, frag, 7);
+	pt2->file_cache_get_stats(pt2, &stats);
+	for ( i = 0, sum[0] = 0; i < FC_HIST_BUCKETS; i++ )
+	    sum[0] += stats.missLatency[i];
+	flag = flag && 7 == stats.misses && 7 == sum[0];
+	for ( i = 0; flag && i < 7; i++ ) {
+	    rPt = pt2->file_cache_file_data(pt2, frag[i]);
+	    flag = rPt && 'A' + i == rPt[0] && 'A' + i == rPt[fragSize[i] - 1]
+		&& (size_t) fragSize[i] == pt2->file_cache_file_size(pt2, frag[i]);
+	}
+	pt2->file_cache_unpin_files(pt2, frag, 7);
+	pt2->file_cache_destroy(pt2);
+    }
+    if ( flag ) {
+	++passed;
+	printf("Batch of misses read in by the io workers PASS.\n");
+    }
+    else
+	printf("Batch of misses read in by the io workers FAIL.\n");
+
+    /* No more than maxOpenFds descriptors are kept by the slots: the files past it are closed
+       after their read and opened again to be written back */
+    file_cache_conf_init(&conf, 16);
+    conf.maxOpenFds = 2;
+    pt2 = file_cache_construct_with(&conf);
+    pt2->file_cache_pin_files(pt2, frag, 7);
+    flag = 2 == __atomic_load_n(&pt2->openFds, __ATOMIC_RELAXED);
+    for ( i = 0; i < 7; i++ ) {
+	wPt = pt2->file_cache_mutable_file_range(pt2, frag[i], 1, 1);
+	if ( wPt )
+	    wPt[1] = 'a' + i;
+    }
+    pt2->file_cache_unpin_files(pt2, frag, 7);
+    flag = flag && 0 == pt2->file_cache_sync(pt2) && 2 == __atomic_load_n(&pt2->openFds, __ATOMIC_RELAXED);
+    pt2->file_cache_destroy(pt2);
+    for ( i = 0; flag && i < 7; i++ )
+	flag = 'a' + i == test_byte(frag[i], 1) && 'A' + i == test_byte(frag[i], 2);
+    if ( flag ) {
+	++passed;
+	printf("Descriptors kept open stay bounded PASS.\n");
+    }
+    else
+	printf("Descriptors kept open stay bounded FAIL.\n");
+    for ( i = 0; i < 7; i++ )
+	unlink(frag[i]);
+
 
     printf("Total Test Case executed: %d: Passed: %d: Failed: %d\n",
 	    total, passed, (total -passed) );
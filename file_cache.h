@@ -35,7 +35,15 @@
 #ifndef _NUTANIX_FILE_CACHE_H_
 #define _NUTANIX_FILE_CACHE_H_
 
+#include <stddef.h>
+#include <pthread.h>
+
 typedef struct file_cache file_cache;
+struct file_cache_stats;
+
+// Handle to a pinned file, see file_cache_pin_handles(). Opaque to the caller.
+typedef int file_cache_handle;
+#define FILE_CACHE_NO_HANDLE (-1)
 
 /*-----------------------------Changes Start from Here ------------------------ */
 
@@ -47,21 +55,81 @@ typedef struct file_cache file_cache;
 
 struct file_cache {
     int maxSize;		   /* Max size of file_cache passed to constructor */
-    int currentSize;               /* Current Size of the file_cache */
+    int currentSize;               /* Number of files currently pinned in the file_cache */
     struct __node_cache *nodeHead; /* Pointer to the head of list of cache nodes */
-    struct file_cache **selfRef;   /* This is used to set the static pt in constructor to NULL. */
-   /* As we cant change the function signature of the constructor and otherwise if once destroy is called,
-      no new instances of file cache can be initialized until a new process calls the constructor because 
-      static variable in constructor is still poninting to same heap memory initialized in previous call to constuctor.
-      So this is set to NULL before freeing the memory in destroy call */
+    int mode;                      /* FILE_CACHE_MODE_COPY or FILE_CACHE_MODE_MMAP */
+    int policy;                    /* FILE_CACHE_POLICY_LRU or FILE_CACHE_POLICY_SLRU */
+    int padTo10Kb;                 /* Buffers of files under 10Kb are 10Kb, see file_cache_conf.padTo10Kb */
+    char *arena;                   /* Page aligned memory the buffers of all slots are allocated from, split
+				      evenly between the shards. NULL in FILE_CACHE_MODE_MMAP, where slots
+				      point into their mapping */
+    size_t arenaSize;              /* Bytes mapped at arena */
+    const char *zeroBuf;           /* Read-only zeros handed out for every slot whose file is all zero,
+				      and in FILE_CACHE_MODE_MMAP for every empty file */
+    size_t zeroSize;               /* Bytes mapped at zeroBuf, enough for the largest slot */
+    size_t maxBytes;               /* Bytes of file data the cache may hold */
+    int numShards;                 /* Number of shards nodeHead is partitioned into, a power of 2 */
+    struct __cache_shard *shards;  /* Array of numShards shards, selected by hash of file name */
+    int dirtySize;                 /* Dirty unpinned slots waiting for the flusher, across all shards */
+
+    /* Background writeback of dirty slots, see flusher_main() in file_cache.c */
+    pthread_t flusher;             /* Thread writing dirty unpinned slots back to disk */
+    pthread_mutex_t flushLock;     /* Protects flushKick, flushStop and the sync counters */
+    pthread_cond_t flushcv;        /* Wakes the flusher before its interval is up */
+    int flushKick;                 /* Set to make the flusher start a pass right away */
+    int flushStop;                 /* Set by destroy: flush everything and exit */
+    int flushIntervalMs;           /* Flusher runs a pass at least this often */
+    int flushHighWater;            /* dirtySize at which an unpin kicks the flusher */
+    int durable;                   /* fdatasync() the file after every writeback, not just for a sync */
+    int groupCommitUs;             /* A pass for file_cache_sync() waits this long for more syncs to join it */
+    unsigned long syncReq;         /* Number of file_cache_sync() calls so far, protected by flushLock */
+    unsigned long syncDone;        /* syncReq as of the start of the last sync pass to complete */
+    unsigned long syncFailed;      /* syncReq of the last sync pass a writeback failed in, 0 if none */
+    pthread_cond_t synccv;         /* Broadcast with flushLock when syncDone moves on */
+    int logFd;                     /* Write log the flusher appends dirty data to, -1 if none. Only the
+				      flusher (and the constructor) touches it and the members below */
+    size_t logSize;                /* Bytes of whole records in the log */
+    size_t logMax;                 /* logSize that makes the flusher checkpoint */
+    int logUnsynced;               /* Records were appended since the log was last synced */
+
+    /* Parallel loading of the misses of a pin batch, see load_batch() in file_cache.c */
+    int ioUring;                   /* Read the misses of a batch through io_uring if the kernel has it */
+    int numIoThreads;              /* Workers in ioThreads. 0 loads the misses in the pinning thread */
+    pthread_t *ioThreads;          /* Pool loading the misses of a batch when io_uring can't */
+    pthread_mutex_t ioLock;        /* Protects ioHead, ioTail and ioStop */
+    pthread_cond_t iocv;           /* Wakes the workers when load jobs are queued */
+    struct __load_job *ioHead;     /* Queued load jobs, oldest first */
+    struct __load_job *ioTail;     /* Newest queued load job */
+    int ioStop;                    /* Set by destroy: workers exit */
+    struct __prefetch *pfHead;     /* Files queued by file_cache_prefetch_files(), oldest first. The
+				      workers get to them when no load job is queued */
+    struct __prefetch *pfTail;     /* Newest queued prefetch */
+    int pfPending;                 /* Prefetches queued, at most maxSize */
+    char *manifestPath;            /* Where destroy and file_cache_save_manifest() list the resident
+				      files, read back by the constructor. NULL if none */
+    int maxOpenFds;                /* Most descriptors kept open by slots at a time */
+    int openFds;                   /* Descriptors kept open by slots, updated atomically */
 
     /* function pointers */
     void (*file_cache_destroy)(file_cache *cache);
 
+    size_t (*file_cache_file_size)(file_cache *cache, const char *file);
+
     void (*file_cache_pin_files)(file_cache *cache,
                           const char **files,
                           int num_files);
 
+    int (*file_cache_try_pin_files)(file_cache *cache,
+                                    const char **files,
+                                    int num_files,
+                                    char *pinned);
+
+    int (*file_cache_timed_pin_files)(file_cache *cache,
+                                      const char **files,
+                                      int num_files,
+                                      int timeout_ms,
+                                      char *pinned);
+
     void (*file_cache_unpin_files)(file_cache *cache,
                             const char **files,
                             int num_files);
@@ -70,16 +138,177 @@ struct file_cache {
 
     char *(*file_cache_mutable_file_data)(file_cache *cache, const char *file);
 
+    char *(*file_cache_mutable_file_range)(file_cache *cache, const char *file,
+                                           size_t offset, size_t len);
+
+    void (*file_cache_prefetch_files)(file_cache *cache,
+                               const char **files,
+                               int num_files);
+
+    void (*file_cache_get_stats)(file_cache *cache, struct file_cache_stats *stats);
+
+    int (*file_cache_sync)(file_cache *cache);
+
+    void (*file_cache_pin_handles)(file_cache *cache,
+                                   const char **files,
+                                   int num_files,
+                                   file_cache_handle *handles);
+
+    void (*file_cache_unpin_handles)(file_cache *cache,
+                                     const file_cache_handle *handles,
+                                     int num_handles);
+
+    const char *(*file_cache_handle_data)(file_cache *cache, file_cache_handle handle);
+
+    size_t (*file_cache_handle_size)(file_cache *cache, file_cache_handle handle);
+
+    char *(*file_cache_mutable_handle_range)(file_cache *cache, file_cache_handle handle,
+                                             size_t offset, size_t len);
+
+    int (*file_cache_save_manifest)(file_cache *cache);
+
+};
+
+/* How the data of a cached file is held, chosen at construction time by file_cache_conf.mode */
+enum {
+    FILE_CACHE_MODE_COPY = 0,   /* Read into the cache's own buffer, written back with a write */
+    FILE_CACHE_MODE_MMAP = 1,   /* Mapped MAP_SHARED from the file, written back with msync() */
+};
+
+/* Which resident unpinned file is evicted first, chosen at construction time by file_cache_conf.policy */
+enum {
+    FILE_CACHE_POLICY_LRU = 0,  /* The least recently unpinned */
+    FILE_CACHE_POLICY_SLRU = 1, /* Segmented LRU: files pinned only once go before files hit again */
+};
 
+/* Tunables for file_cache_construct_with(). Initialize with file_cache_conf_init() and then
+ * override only the members of interest, so that new members get sane defaults.
+ */
+struct file_cache_conf {
+    int maxEntries;     /* Maximum number of files cached at any time */
+    size_t maxBytes;    /* Maximum bytes of file data cached at any time. 0 leaves room for maxEntries files of 10Kb */
+    int numShards;      /* Number of lock shards, rounded down to a power of 2. 0 derives it from maxEntries */
+    int flushIntervalMs;/* Period of the background flusher. 0 flushes only on high water or when a pin waits */
+    int flushHighWater; /* Number of dirty unpinned files that wakes the flusher early */
+    int hugePages;      /* Back the buffer arena with huge pages if the system has them reserved */
+    int mode;           /* FILE_CACHE_MODE_COPY (default) or FILE_CACHE_MODE_MMAP */
+    int ioThreads;      /* Workers loading the misses of a pin batch in parallel. 0 loads them one by one */
+    int ioUring;        /* Read the misses of a batch with io_uring where the kernel has it (default 1) */
+    int maxOpenFds;     /* Descriptors of cached files kept open for reuse. 0 opens the file for every I/O */
+    int policy;         /* FILE_CACHE_POLICY_LRU (default), or FILE_CACHE_POLICY_SLRU to keep a scan
+			   of files read once from evicting the files in steady use */
+    int durable;        /* fdatasync() every writeback of the flusher, so that data written back is on disk */
+    int groupCommitUs;  /* Window in which concurrent file_cache_sync() calls share one pass (default 1000) */
+    const char *logPath;/* Write log: dirty data is appended to this file and synced there, and
+			   written in place lazily. Replayed by the constructor. NULL for none (default).
+			   Not used in FILE_CACHE_MODE_MMAP */
+    size_t logMaxBytes; /* Size of the write log that triggers a checkpoint. 0 for the default 64Mb */
+    const char *manifestPath;/* Warm restart: the constructor reads back the files listed here in the
+			   background, and destroy lists the resident files here for the next cache.
+			   Only written with ioThreads 0. NULL for none (default) */
+    int padTo10Kb;      /* Give a file under 10Kb a 10Kb buffer, zeros past its end, for callers of the
+			   10Kb contract. 0 (default) sizes every buffer to its file, in 512 byte units */
 };
 
+#define FC_HIST_BUCKETS 32  /* Buckets of a latency histogram: bucket i counts [2^i, 2^(i+1)) microseconds */
+
+/* Counters of a cache since it was constructed, filled in by file_cache_get_stats(). Every shard
+ * keeps its own set, bumped under its lock, and they are summed on the way out.
+ */
+struct file_cache_stats {
+    unsigned long long hits;          /* Files pinned that were cached and read in */
+    unsigned long long misses;        /* Files pinned that were not, read in for the pin or by one in flight */
+    unsigned long long prefetches;    /* Files read in by a prefetch, ahead of any pin */
+    unsigned long long evictions;     /* Clean unpinned files dropped to make room */
+    unsigned long long writebacks;    /* Dirty files written back */
+    unsigned long long unchangedFlushes; /* Dirty files not written back, their data matched its checksum */
+    unsigned long long pinWaits;      /* Times a pin blocked for a slot or for room */
+    unsigned long long bytesRead;     /* Bytes of file data read in (mapped in FILE_CACHE_MODE_MMAP) */
+    unsigned long long bytesWritten;  /* Bytes written back */
+    unsigned long long missLatency[FC_HIST_BUCKETS];  /* Per miss: time until its batch's reads landed */
+    unsigned long long flushLatency[FC_HIST_BUCKETS]; /* Per writeback: time the write (or msync) took */
+    unsigned long long waitLatency[FC_HIST_BUCKETS];  /* Per blocked pin: time it waited */
+};
+
+#define FC_ORDERS 22        /* Block orders of the shard allocators: 512 bytes << 0 .. 21 */
+#define FC_DIRTY_WORDS 4    /* 64 bit words in the dirty map of a slot, 256 granules */
+
+/* A shard owns the contiguous run of slots nodeHead[firstSlot .. firstSlot+maxSize) and its share
+ * of the arena, along with the name index, lock and condition variables for them. A file always lives in the shard picked
+ * by the hash of its name, so pins of files in different shards never contend.
+ * Aligned to a cache line so that neighbouring shard locks don't false share.
+ */
+struct __cache_shard {
+    pthread_mutex_t lock;   /* Serializes pin & unpin of the files of this shard */
+    pthread_cond_t slotcv;  /* Broadcast when a slot of this shard is freed or becomes evictable, for
+			       the pins waiting for bytes; pins waiting for slots queue on admitHead */
+    pthread_cond_t loadcv;  /* Broadcast when the load of a slot of this shard finishes */
+    int firstSlot;          /* First slot in nodeHead owned by this shard */
+    int maxSize;            /* Number of slots owned by this shard */
+    int currentSize;        /* Slots of this shard holding a file, pinned or not */
+    int lruHead;            /* Least recently used unpinned slot, first to be evicted. -1 if none */
+    int lruTail;            /* Most recently unpinned slot. -1 if none */
+    int lruSize;            /* Number of slots on the LRU list */
+    int protHead;           /* FILE_CACHE_POLICY_SLRU: protected list of the slots hit again while
+			       resident, evicted only once the LRU list is empty. -1 if none */
+    int protTail;           /* Most recently unpinned protected slot. -1 if none */
+    int protSize;           /* Number of slots on the protected list */
+    int protMax;            /* Most slots the protected list holds, the oldest beyond go back on the LRU list */
+    int dirtyHead;          /* Dirty unpinned slots, oldest first, waiting for the flusher. -1 if none */
+    int dirtyTail;          /* Newest dirty unpinned slot. -1 if none */
+    int dirtySize;          /* Number of slots on the dirty list */
+    int freeHead;           /* Free slots, chained through lruNext. -1 if none */
+    int reserved;           /* Free or LRU slots promised to admitted pin batches, not taken yet */
+    struct __admit *admitHead;  /* Pin batches waiting for slots, in arrival order. NULL if none */
+    struct __admit *admitTail;  /* Last batch to queue up */
+    struct file_cache_stats stats;  /* Counters of the shard, see file_cache_get_stats(). The
+				       counts come first, next to the fields a hit touches */
+    size_t maxBytes;        /* Bytes of file data the shard may hold */
+    size_t usedBytes;       /* Bytes taken by the buffers (or mappings) of its slots */
+    char *arena;            /* The shard's run of the cache's arena, NULL in FILE_CACHE_MODE_MMAP */
+    int arenaUnits;         /* Size of the run in blocks of 512 bytes */
+    int maxOrder;           /* Order of the largest block the run can hold */
+    int freeBlock[FC_ORDERS];   /* Buddy allocator: first free block of each order, -1 if none */
+    unsigned char *blockOrder;  /* Per 512 byte unit: order + 1 if a free block starts there, else 0 */
+    struct __name_buf *retiredNames;  /* Name buffers slots have outgrown, freed with the shard */
+
+    /* Read without the lock by file_cache_file_data(), on a line of their own, see index_read() */
+    unsigned int seq __attribute__((aligned(64)));  /* Seqlock of the name index: odd while the
+						       index or the identity of a slot changes */
+    unsigned int hashMask;  /* Number of buckets in hashHead - 1 (bucket count is a power of 2) */
+    int *hashHead;          /* Name index: bucket array of slot numbers into nodeHead, -1 if empty */
+} __attribute__((aligned(64)));
+
 /* Definition of struct node_cache. See inline commints for each member role. */
 
 struct __node_cache {
     int refCount;       /* Reference Count for each cache data - Cant Unpin until > 0 */
     char dirty;         /* Dirty Byte. If set cache should be flushed to Disk before Unpining  */
-    char *name;         /* Name of the file as specified in Pin API call assuming to be a absolute path */
-    char *cache;        /* Pointer to 10Kb char buffer. */
+    char *name;         /* Name of the file as specified in Pin API call assuming to be a absolute path.
+			   Points into a struct __name_buf kept across evictions and only grown */
+    size_t nameLen;     /* strlen(name), compared along with hash before the name itself */
+    char *cache;        /* Pointer to the slot's buffer in the arena, or to the file's mapping */
+    size_t size;        /* Bytes of file data at cache, the size of the file when it was loaded */
+    int fd;             /* Descriptor the file was read through, kept for writeback. -1 if none */
+    unsigned int hash;  /* Hash of name, compared before the strcmp() in a lookup */
+    int hnext;          /* Next slot in the same hashHead bucket chain, -1 at the end */
+    int lruPrev;        /* Unpinned slots of a shard are on its LRU or dirty list: older neighbour, -1 at head */
+    int lruNext;        /* Newer neighbour on the list, -1 at tail */
+    char onList;        /* Which list the slot is on: 0 none, FC_LIST_LRU, FC_LIST_PROT, FC_LIST_DIRTY or FC_LIST_FREE */
+    char hot;           /* Hit since it was read in (or last left the protected list): FILE_CACHE_POLICY_SLRU
+			   puts it on the protected list when unpinned */
+    char prefetched;    /* Read in by a prefetch or warm restart and not pinned for real since, see hot */
+    char flushing;      /* Flusher is writing the slot back, it sits on no list until done */
+    char loading;       /* Claimed by a pin whose read is in flight. Other pinners wait on loadcv */
+    char loadFailed;    /* The read failed or found no file. Freed when the last pin on it is dropped */
+    char readOnly;      /* FILE_CACHE_MODE_MMAP: the file could only be opened read-only and is mapped
+			   PROT_READ, it can't be made mutable */
+    unsigned int crc;   /* CRC32C of the file data as read in or last written back, FILE_CACHE_MODE_COPY */
+    char crcValid;      /* crc is what the file holds. Cleared when the slot is written to during a writeback */
+    char zero;          /* File data is all zero: readers get the cache's zeroBuf and the slot's own buffer
+			   is left untouched until file_cache_mutable_file_range() copies on write */
+    unsigned char dirtyShift;   /* log2 of the bytes covered by one bit of dirtyMap: 9, 12 or more */
+    unsigned long long dirtyMap[FC_DIRTY_WORDS];  /* Granules written since the last writeback */
 }; 
 
 /* Simple definition of a variadic debug printf function for debugging purpose */
@@ -101,9 +330,21 @@ struct __node_cache {
 
 // Constructor. 'max_cache_entries' is the maximum number of files that can
 // be cached at any time.
+// Every call returns a new cache, independent of any other in the process:
+// each has its own capacity, locks and threads and is destroyed on its own.
 struct file_cache *file_cache_construct(int max_cache_entries);
 
-// Destructor. Flushes all dirty buffers.
+// Fill 'conf' with the defaults for a cache of 'max_cache_entries' files.
+void file_cache_conf_init(struct file_cache_conf *conf, int max_cache_entries);
+
+// Constructor taking explicit tunables. file_cache_construct(n) is
+// file_cache_construct_with() on a conf initialized for n entries.
+// With conf->logPath set, the records a crash left in the write log are
+// first written to their files; NULL is returned if that fails.
+struct file_cache *file_cache_construct_with(const struct file_cache_conf *conf);
+
+// Destructor. Flushes all dirty buffers, and syncs them to disk if the cache
+// was constructed with file_cache_conf.durable set.
 void file_cache_destroy(file_cache *cache);
 
 // Pins the given files in array 'files' with size 'num_files' in the cache.
@@ -130,6 +371,94 @@ void file_cache_pin_files(file_cache *cache,
                           const char **files,
                           int num_files);
 
+// Same as file_cache_pin_files(), but also sets handles[i] to a handle of
+// files[i], or to FILE_CACHE_NO_HANDLE if it didn't get pinned (e.g. it
+// didn't exist and was created). The handle stands for one pin of the file:
+// file_cache_unpin_handles() gives it back, and the data calls below take it
+// in place of the name, skipping the lookup. A handle is only valid until it
+// is unpinned. A file may be unpinned by name or by handle, whichever way it
+// was pinned.
+void file_cache_pin_handles(file_cache *cache,
+                            const char **files,
+                            int num_files,
+                            file_cache_handle *handles);
+
+// Unpin the pins behind 'handles', as file_cache_unpin_files() does.
+// FILE_CACHE_NO_HANDLE entries are skipped.
+void file_cache_unpin_handles(file_cache *cache,
+                              const file_cache_handle *handles,
+                              int num_handles);
+
+// file_cache_file_data(), file_cache_file_size() and
+// file_cache_mutable_file_range() of the file pinned through 'handle'. They
+// cost O(1): no hashing or comparing of the name. Undefined behavior if the
+// handle isn't pinned.
+const char *file_cache_handle_data(file_cache *cache, file_cache_handle handle);
+size_t file_cache_handle_size(file_cache *cache, file_cache_handle handle);
+char *file_cache_mutable_handle_range(file_cache *cache, file_cache_handle handle,
+                                      size_t offset, size_t len);
+
+// Non-blocking file_cache_pin_files(). Where the pin would have to wait for
+// another thread, e.g. for room in a cache full of pinned or dirty files, it
+// gives up at once and drops the pins it took, so that either the whole
+// batch is pinned or none of it. The misses of the batch are still read in.
+// If 'pinned' is not NULL, pinned[i] is set to 1 if files[i] got pinned and
+// to 0 if not (a file that doesn't exist or can't fit isn't pinned, as with
+// file_cache_pin_files()). Returns the number of files pinned, or -1 if the
+// batch gave up.
+int file_cache_try_pin_files(file_cache *cache,
+                             const char **files,
+                             int num_files,
+                             char *pinned);
+
+// Same as file_cache_try_pin_files(), but waits up to 'timeout_ms'
+// milliseconds in total for other threads before giving up.
+int file_cache_timed_pin_files(file_cache *cache,
+                               const char **files,
+                               int num_files,
+                               int timeout_ms,
+                               char *pinned);
+
+// Starts reading the given files into the cache in the background and
+// returns right away. The files are not pinned: each lands as a resident,
+// evictable entry, as if it had been pinned and unpinned, so that a later
+// file_cache_pin_files() of it is a hit. It is only a hint. A file that
+// can't be cached without waiting (e.g. every slot is pinned) is skipped,
+// and the cache queues at most 'max_cache_entries' files at a time. A file
+// that doesn't exist is skipped, not created as by a pin. With no io workers
+// (file_cache_conf.ioThreads 0) the files are read before it returns.
+void file_cache_prefetch_files(file_cache *cache,
+                               const char **files,
+                               int num_files);
+
+// Writes the names of the resident files to file_cache_conf.manifestPath,
+// most recently used first, replacing the manifest there atomically.
+// Destroy does the same. A cache constructed with the same manifestPath reads
+// those files back in the background, the most recently used first and in
+// between the misses of the pins, as file_cache_prefetch_files() would, so it
+// doesn't start cold. A file deleted in the meantime is skipped, not created.
+// A cache without io workers (file_cache_conf.ioThreads 0) doesn't read the
+// manifest back, as it would have to before the constructor returns.
+// Returns 0 on success, -1 if the cache has no manifestPath or the manifest
+// can't be written.
+int file_cache_save_manifest(file_cache *cache);
+
+// Writes every file that is dirty when called, pinned or not, back to
+// disk with an fdatasync() per file and returns once that is done: 0 on
+// success, -1 if a file couldn't be written. Calls made by other threads
+// within file_cache_conf.groupCommitUs of each other share one pass of the
+// flusher, so many small durable updates cost about one sync each file.
+// A pinned file stays dirty after it is written back, as its pinner may
+// still write through the mutable pointer it holds.
+int file_cache_sync(file_cache *cache);
+
+// Fills 'stats' with the counters of the cache since it was constructed:
+// hits, misses, evictions, writebacks, blocked pins, bytes moved, and
+// histograms of miss read, writeback and blocked pin latencies. Each shard
+// is read under its lock, so the sum is not one atomic snapshot of the
+// whole cache while other threads are busy with it.
+void file_cache_get_stats(file_cache *cache, struct file_cache_stats *stats);
+
 // Unpin one or more files that were previously pinned. It is ok to unpin
 // only a subset of the files that were previously pinned using
 // file_cache_pin_files(). It is undefined behavior to unpin a file that wasn't
@@ -141,9 +470,22 @@ void file_cache_unpin_files(file_cache *cache,
 // Provide read-only access to a pinned file's data in the cache.
 //
 // It is undefined behavior if the file is not pinned, or to access the buffer
-// when the file isn't pinned.
+// when the file isn't pinned. A file that is all zero, such as one the cache
+// has just created, is served from a buffer of zeros shared by all such
+// files; the pointer changes to the file's own buffer once it is made
+// mutable, so fetch it again after a file_cache_mutable_file_data() call.
+//
+// Files are no longer all 10KB: the buffer holds file_cache_file_size()
+// bytes. For callers written against the 10KB contract, a cache constructed
+// with file_cache_conf.padTo10Kb makes it never shorter than 10KB, the bytes
+// past the end of a shorter file reading as zeros. In FILE_CACHE_MODE_MMAP the buffer is the file's mapping and ends with the
+// file's last page.
 const char *file_cache_file_data(file_cache *cache, const char *file);
 
+// Size in bytes of a pinned file's data in the cache, as found by fstat()
+// when the file was read in. Returns 0 if the file is not pinned.
+size_t file_cache_file_size(file_cache *cache, const char *file);
+
 // Provide write access to a pinned file's data in the cache. This call marks
 // the file's data as 'dirty'. The caller may update the contents of the file
 // by writing to the memory pointed by the returned value.
@@ -153,7 +495,23 @@ const char *file_cache_file_data(file_cache *cache, const char *file);
 // the application does this correctly).
 //
 // It is undefined behavior if the file is not pinned, or to access the buffer
-// when the file is not pinned.
+// when the file is not pinned. Data that is left as it was is not written
+// back, so it is cheap to ask for access that may not be used. Only the
+// file's own bytes are written back: with file_cache_conf.padTo10Kb a write
+// past the end of a file shorter than 10KB stays inside its buffer but never
+// reaches the disk, where a file used to be written back as a whole 10KB.
+// Without it writing past the end of the file is undefined behavior.
+// In FILE_CACHE_MODE_MMAP a file that can only be opened read-only is
+// mapped read-only, and NULL is returned for it.
 char *file_cache_mutable_file_data(file_cache *cache, const char *file);
 
+// Like file_cache_mutable_file_data(), but marks only the 'len' bytes at
+// 'offset' dirty, so that writeback rewrites just the part of the file that
+// changed (rounded out to 512 bytes, 4Kb for files over 128Kb). The returned
+// pointer is to the start of the file's data, as above, and the caller must
+// write only inside the range it marked; a range past the end of the file is
+// clipped to it. Returns NULL if the file is not pinned.
+char *file_cache_mutable_file_range(file_cache *cache, const char *file,
+                                    size_t offset, size_t len);
+
 #endif  // _NUTANIX_FILE_CACHE_H_
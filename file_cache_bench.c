@@ -0,0 +1,375 @@
+/**
+ * Multi threaded throughput and latency benchmark for the file_cache in file_cache.c
+ *
+ * Build: make file_cache_bench, or gcc -O2 -pthread file_cache.c file_cache_bench.c -o file_cache_bench -lm
+ *
+ * Usage: ./file_cache_bench [-d dir] [-f files] [-e entries] [-s shards] [-t threads] [-n secs]
+ *                           [-p uniform|zipf|scan] [-z theta] [-w writes] [-P lru|slru] [-m] [-H]
+ *   -d  scratch directory the files are created in, e.g. a tmpfs like /dev/shm (default /tmp)
+ *   -f  number of files in the working set (default 1024)
+ *   -e  max_cache_entries of the cache (default 4096)
+ *   -s  number of shards, 0 lets the cache pick (default 0)
+ *   -t  highest thread count, the run doubles from 1 up to it (default 32)
+ *   -n  seconds each thread count runs for (default 2)
+ *   -p  access pattern, see below (default uniform)
+ *   -z  skew of the zipf pattern, larger is more skewed (default 0.99)
+ *   -w  percent of the cycles that write to the file they pin (default 0)
+ *   -P  replacement policy of the cache (default lru)
+ *   -m  miss mode, see below
+ *   -H  back the cache's buffer arena with huge pages
+ *
+ * Every thread loops pin -> read first byte (or write it) -> unpin on a file of the working set,
+ * and the benchmark prints for each thread count the ops/sec, the scaling over one thread, the
+ * p50/p99/p999 latency of the pin call and the hit ratio the cache reports.
+ * The file a cycle works on is picked by the access pattern:
+ *   uniform  any file of the set with the same odds
+ *   zipf     file i with odds proportional to 1 / (i + 1)^theta, a few files take most cycles
+ *   scan     every thread walks the whole set in order, each from its own starting point
+ * By default the main thread keeps every file pinned for the whole run so that all pins are hits
+ * and the loop measures the synchronization of the cache itself. With -m nothing is held, so
+ * unpinned files can be evicted; use more files than entries to make pins miss and read from disk.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include "file_cache.h"
+
+enum { PATTERN_UNIFORM, PATTERN_ZIPF, PATTERN_SCAN };
+
+#define LAT_SUB 16                    /* Sub-buckets per power of 2 of the latency histogram */
+#define LAT_BUCKETS (61 * LAT_SUB)    /* Covers every 64 bit count of nanoseconds */
+
+struct bench_thread {
+    pthread_t tid;
+    file_cache *cache;
+    unsigned int seed;
+    int next;                 /* scan pattern: next file to pin */
+    unsigned long ops;        /* pin/unpin cycles done by this thread */
+    unsigned long long *lat;  /* LAT_BUCKETS counts of pin latencies, see lat_bucket() */
+} __attribute__((aligned(64)));
+
+static char **names;              /* working set of file names */
+static int numFiles = 1024;
+static int pattern = PATTERN_UNIFORM;
+static int writePct;              /* percent of cycles writing to their file */
+static double *zipfCdf;           /* zipf pattern: odds of picking a file <= i, increasing to 1 */
+static volatile int stop;         /* set by main thread when the run is over */
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long long now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* @ret: histogram bucket of a latency of 'ns' nanoseconds. Below LAT_SUB each nanosecond has a
+ *   bucket, above that each power of 2 is split into LAT_SUB buckets, so a bucket is within 1/16th.
+ */
+static int lat_bucket(unsigned long long ns)
+{
+    int e;
+
+    if ( ns < LAT_SUB )
+	return ns;
+    e = 63 - __builtin_clzll(ns);         /* 2^e <= ns < 2^(e+1), e >= 4 */
+    return (e - 3) * LAT_SUB + (int) ((ns >> (e - 4)) & (LAT_SUB - 1));
+}
+
+/* @ret: the smallest latency in nanoseconds counted in bucket 'b', the inverse of lat_bucket(). */
+static unsigned long long lat_value(int b)
+{
+    if ( b < LAT_SUB )
+	return b;
+    return (unsigned long long) (LAT_SUB + b % LAT_SUB) << (b / LAT_SUB - 1);
+}
+
+/* @ret: latency in microseconds that a fraction 'q' of the 'total' pins counted in 'lat' beat. */
+static double lat_quantile(const unsigned long long *lat, unsigned long long total, double q)
+{
+    unsigned long long seen = 0;
+    int b;
+
+    for ( b = 0; b < LAT_BUCKETS; b++ ) {
+	seen += lat[b];
+	if ( seen > 0 && seen >= q * total )
+	    return lat_value(b) / 1e3;
+    }
+    return 0;
+}
+
+/* Fills zipfCdf for skew 'theta'. @ret: 0, or -1 if out of memory. */
+static int zipf_init(double theta)
+{
+    double sum = 0;
+    int i;
+
+    zipfCdf = malloc(numFiles * sizeof(double));
+    if ( !zipfCdf )
+	return -1;
+    for ( i = 0; i < numFiles; i++ ) {
+	sum += 1.0 / pow(i + 1, theta);
+	zipfCdf[i] = sum;
+    }
+    for ( i = 0; i < numFiles; i++ )
+	zipfCdf[i] /= sum;
+    return 0;
+}
+
+/* @ret: index of the file the next cycle of 'bt' works on, per the access pattern. */
+static int pick_file(struct bench_thread *bt)
+{
+    double u;
+    int lo, hi, mid;
+
+    switch ( pattern ) {
+    case PATTERN_ZIPF:
+	u = rand_r(&bt->seed) / (RAND_MAX + 1.0);
+	for ( lo = 0, hi = numFiles - 1; lo < hi; ) {
+	    mid = (lo + hi) / 2;
+	    if ( zipfCdf[mid] < u )
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	return lo;
+    case PATTERN_SCAN:
+	if ( bt->next >= numFiles )
+	    bt->next = 0;
+	return bt->next++;
+    default:
+	return rand_r(&bt->seed) % numFiles;
+    }
+}
+
+/* Thread body: pin, touch and unpin files of the working set until told to stop. */
+static void *bench_loop(void *arg)
+{
+    struct bench_thread *bt = (struct bench_thread *) arg;
+    const char *file;
+    const char *data;
+    char *wdata;
+    unsigned long ops = 0;
+    unsigned long long start;
+    volatile char sink;
+
+    while ( !stop ) {
+	file = names[pick_file(bt)];
+	start = now_nsec();
+	bt->cache->file_cache_pin_files(bt->cache, &file, 1);
+	bt->lat[lat_bucket(now_nsec() - start)]++;
+	if ( writePct > 0 && (int) (rand_r(&bt->seed) % 100) < writePct ) {
+	    wdata = bt->cache->file_cache_mutable_file_range(bt->cache, file, 0, 1);
+	    if ( wdata )
+		wdata[0] += 1;
+	}
+	else {
+	    data = bt->cache->file_cache_file_data(bt->cache, file);
+	    if ( data )
+		sink = data[0];
+	}
+	bt->cache->file_cache_unpin_files(bt->cache, &file, 1);
+	ops++;
+    }
+    (void) sink;
+    bt->ops = ops;
+    return NULL;
+}
+
+/* @ret: ops/sec of 'nthreads' threads running bench_loop() for 'secs' seconds. The pin latencies
+ *   of all threads are added up in 'lat', and their count stored in 'total'.
+ */
+static double bench_run(file_cache *cache, int nthreads, int secs, unsigned long long *lat,
+			unsigned long long *total)
+{
+    struct bench_thread *bt;
+    unsigned long ops = 0;
+    double start, elapsed;
+    int i, b;
+
+    *total = 0;
+    bt = calloc(nthreads, sizeof(struct bench_thread));
+    if ( !bt )
+	return 0;
+    for ( i = 0; i < nthreads; i++ ) {
+	bt[i].lat = calloc(LAT_BUCKETS, sizeof(unsigned long long));
+	if ( !bt[i].lat ) {
+	    while ( i-- > 0 )
+		free(bt[i].lat);
+	    free(bt);
+	    return 0;
+	}
+    }
+
+    stop = 0;
+    start = now_sec();
+    for ( i = 0; i < nthreads; i++ ) {
+	bt[i].cache = cache;
+	bt[i].seed = i + 1;
+	bt[i].next = (long) numFiles * i / nthreads;
+	pthread_create(&bt[i].tid, NULL, bench_loop, &bt[i]);
+    }
+    sleep(secs);
+    stop = 1;
+    memset(lat, 0, LAT_BUCKETS * sizeof(unsigned long long));
+    for ( i = 0; i < nthreads; i++ ) {
+	pthread_join(bt[i].tid, NULL);
+	ops += bt[i].ops;
+	for ( b = 0; b < LAT_BUCKETS; b++ )
+	    lat[b] += bt[i].lat[b];
+	free(bt[i].lat);
+    }
+    elapsed = now_sec() - start;
+    free(bt);
+    *total = ops;
+    return ops / elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    struct file_cache_conf conf;
+    struct file_cache_stats before, after;
+    file_cache *cache;
+    const char *dir = "/tmp";
+    int entries = 4096, shards = 0, maxThreads = 32, secs = 2, missMode = 0, hugePages = 0;
+    int policy = FILE_CACHE_POLICY_LRU;
+    int i, opt, nthreads;
+    double base = 0, ops, theta = 0.99, lookups;
+    unsigned long long lat[LAT_BUCKETS], total;
+    char fill[10240];
+    FILE *fp;
+
+    while ( (opt = getopt(argc, argv, "d:f:e:s:t:n:p:z:w:P:mH")) != -1 ) {
+	switch ( opt ) {
+	case 'd': dir = optarg; break;
+	case 'f': numFiles = atoi(optarg); break;
+	case 'e': entries = atoi(optarg); break;
+	case 's': shards = atoi(optarg); break;
+	case 't': maxThreads = atoi(optarg); break;
+	case 'n': secs = atoi(optarg); break;
+	case 'p':
+	    if ( !strcmp(optarg, "uniform") )
+		pattern = PATTERN_UNIFORM;
+	    else if ( !strcmp(optarg, "zipf") )
+		pattern = PATTERN_ZIPF;
+	    else if ( !strcmp(optarg, "scan") )
+		pattern = PATTERN_SCAN;
+	    else {
+		fprintf(stderr, "unknown pattern %s, use uniform, zipf or scan\n", optarg);
+		return 1;
+	    }
+	    break;
+	case 'z': theta = atof(optarg); break;
+	case 'w': writePct = atoi(optarg); break;
+	case 'P':
+	    if ( !strcmp(optarg, "lru") )
+		policy = FILE_CACHE_POLICY_LRU;
+	    else if ( !strcmp(optarg, "slru") )
+		policy = FILE_CACHE_POLICY_SLRU;
+	    else {
+		fprintf(stderr, "unknown policy %s, use lru or slru\n", optarg);
+		return 1;
+	    }
+	    break;
+	case 'm': missMode = 1; break;
+	case 'H': hugePages = 1; break;
+	default:
+	    fprintf(stderr, "usage: %s [-d dir] [-f files] [-e entries] [-s shards] [-t threads] [-n secs]"
+		    " [-p uniform|zipf|scan] [-z theta] [-w writes] [-P lru|slru] [-m] [-H]\n", argv[0]);
+	    return 1;
+	}
+    }
+    if ( numFiles <= 0 || entries <= 0 || maxThreads <= 0 || secs <= 0 ) {
+	fprintf(stderr, "files, entries, threads and secs must be positive\n");
+	return 1;
+    }
+    if ( writePct < 0 || writePct > 100 || theta < 0 ) {
+	fprintf(stderr, "writes must be a percentage and theta not negative\n");
+	return 1;
+    }
+    if ( !missMode && numFiles > entries ) {
+	fprintf(stderr, "hit mode pins the whole working set, need files <= entries\n");
+	return 1;
+    }
+    if ( PATTERN_ZIPF == pattern && zipf_init(theta) )
+	return 1;
+
+    /* Create the working set, 10Kb of data per file. Not zeros: those would take the cache's
+       shortcut for all-zero files and never copy a buffer */
+    names = malloc(numFiles * sizeof(char *));
+    if ( !names )
+	return 1;
+    for ( i = 0; i < numFiles; i++ ) {
+	names[i] = malloc(strlen(dir) + 32);
+	if ( !names[i] )
+	    return 1;
+	sprintf(names[i], "%s/fcbench.%d", dir, i);
+	fp = fopen(names[i], "w");
+	if ( !fp ) {
+	    perror(names[i]);
+	    return 1;
+	}
+	memset(fill, 'a' + i % 26, sizeof(fill));
+	if ( fwrite(fill, 1, sizeof(fill), fp) != sizeof(fill) || fclose(fp) ) {
+	    perror(names[i]);
+	    return 1;
+	}
+    }
+
+    file_cache_conf_init(&conf, entries);
+    conf.numShards = shards;
+    conf.hugePages = hugePages;
+    conf.policy = policy;
+    cache = file_cache_construct_with(&conf);
+    if ( !cache ) {
+	fprintf(stderr, "can't construct file_cache\n");
+	return 1;
+    }
+    if ( !missMode )
+	cache->file_cache_pin_files(cache, (const char **) names, numFiles);
+
+    printf("files %d entries %d shards %d mode %s pattern %s writes %d%% policy %s\n", numFiles,
+	   entries, cache->numShards, missMode ? "miss" : "hit",
+	   PATTERN_ZIPF == pattern ? "zipf" : PATTERN_SCAN == pattern ? "scan" : "uniform", writePct,
+	   FILE_CACHE_POLICY_SLRU == policy ? "slru" : "lru");
+    printf("%8s %14s %8s %10s %10s %10s %8s\n", "threads", "ops/sec", "speedup",
+	   "p50 us", "p99 us", "p999 us", "hit %");
+    for ( nthreads = 1; nthreads <= maxThreads; nthreads <<= 1 ) {
+	cache->file_cache_get_stats(cache, &before);
+	ops = bench_run(cache, nthreads, secs, lat, &total);
+	cache->file_cache_get_stats(cache, &after);
+	if ( 1 == nthreads )
+	    base = ops;
+	lookups = (after.hits - before.hits) + (after.misses - before.misses);
+	printf("%8d %14.0f %8.2f %10.2f %10.2f %10.2f %8.2f\n", nthreads, ops,
+	       base > 0 ? ops / base : 0, lat_quantile(lat, total, 0.5), lat_quantile(lat, total, 0.99),
+	       lat_quantile(lat, total, 0.999),
+	       lookups > 0 ? 100.0 * (after.hits - before.hits) / lookups : 0);
+	fflush(stdout);
+    }
+
+    if ( !missMode )
+	cache->file_cache_unpin_files(cache, (const char **) names, numFiles);
+    cache->file_cache_destroy(cache);
+
+    for ( i = 0; i < numFiles; i++ ) {
+	unlink(names[i]);
+	free(names[i]);
+    }
+    free(names);
+    free(zipfCdf);
+    return 0;
+}